@@ -1,18 +1,33 @@
-#define _XOPEN_SOURCE 700
+#define _GNU_SOURCE     // for syscall(), IFTODT and DT_* constants
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
-#include <strings.h>    // for strncasecmp
+#include <ctype.h>
 #include <dirent.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/sysmacros.h>
+#include <sys/inotify.h>
+#include <poll.h>
+#include <linux/io_uring.h>
+#include <fcntl.h>
 #include <unistd.h>
+#include <getopt.h>
+#include <fnmatch.h>
 #include <pwd.h>
 #include <grp.h>
 #include <time.h>
 #include <limits.h>
 #include <errno.h>
+#include <locale.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 // ANSI color codes
 #define COLOR_BLUE     "\033[0;34m"
@@ -22,15 +37,438 @@
 #define COLOR_REVERSE  "\033[7m"
 #define COLOR_RESET    "\033[0m"
 
+// ---- Directory entry record (one lstat per entry, shared by all users) ----
+struct file_entry {
+    const char *name;       // points into the listing's name arena
+    size_t name_off;        // offset of the name in the arena
+    unsigned char d_type;   // DT_* from getdents64 (DT_UNKNOWN if fs doesn't say)
+    ino_t d_ino;            // inode number from getdents64, for stat ordering
+    struct stat st;
+    int stat_ok;        // non-zero if st holds a valid lstat result
+    int stat_errno;     // errno from lstat when stat_ok is 0
+    unsigned char hidden;   // failed a filter; kept only so -R still descends
+};
+
+// ---- io_uring stat backend: statx for a whole directory in batches ----
+#define URING_ENTRIES 256
+#define STAT_CHUNK 256          // entries a stat pool thread claims at a time
+#define STAT_POOL_MIN 2048      // fewer stats than this aren't worth threads
+#define STAT_EVERY (-1)         // display_mode for stat_entries(): every entry (cache fill)
+
+struct uring {
+    int fd;                         // -1: not set up yet; -2: unavailable
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_sz, cq_ring_sz, sqes_sz;
+    unsigned entries;
+};
+
+// ---- One directory's entries: names packed in an arena, one bulk free ----
+struct dir_listing {
+    char *names;            // arena: NUL-terminated names back to back
+    size_t names_len;
+    size_t names_cap;
+    struct file_entry *ents;
+    int n;
+    int cap;
+    int maxlen;             // longest name, for column layout
+    uint64_t du_bytes;      // --du: apparent size of the entries (listed or not)
+    uint64_t du_blocks;     // --du: their st_blocks (512-byte units)
+    char *du_dirs;          // --du -R: unlisted subdirectories, names packed
+    size_t du_dirs_len;
+    size_t du_dirs_cap;
+};
+
+// ---- Directory reader (getdents64 with a large buffer, keeps d_type) ----
+#define DIRBUF_SIZE (256 * 1024)
+
+struct linux_dirent64 {
+    ino64_t        d_ino;
+    off64_t        d_off;
+    unsigned short d_reclen;
+    unsigned char  d_type;
+    char           d_name[];
+};
+
+struct dir_reader {
+    int fd;         // directory fd, owned by the caller
+    char *buf;
+    long len;       // bytes valid in buf
+    long pos;       // offset of next record in buf
+    int err;        // errno of a failed getdents64, 0 otherwise
+};
+
+// ---- Output buffer: rows are built here and flushed with write()/writev() ----
+#define OUTBUF_SIZE (256 * 1024)
+
+struct outbuf {
+    char *data;
+    size_t len;
+    size_t cap;
+    int fd;                 // flush target; -1 = memory only, grows instead
+};
+
+// ---- LS_COLORS: per-type colors plus a reversed-suffix trie for "*sfx" rules ----
+enum color_slot { CS_FILE, CS_DIR, CS_LINK, CS_FIFO, CS_SOCK, CS_BLK, CS_CHR,
+                  CS_EXEC, CS_COUNT };
+
+/*
+ * Suffix rules are stored reversed and lowercased, so one walk from the
+ * end of a name finds the longest matching rule no matter how many
+ * rules exist.  Edges live in an open-addressing hash keyed by
+ * (node, byte); node 0 is the root.
+ */
+struct suffix_trie {
+    uint32_t *edge_key;         // node * 256 + byte + 1; 0 marks an empty slot
+    uint32_t *edge_child;
+    size_t edge_cap;            // power of two
+    size_t edge_count;
+    const char **node_color;    // escape for a rule ending at this node, or NULL
+    size_t nodes;
+    size_t node_cap;
+};
+
+// ---- Sort record: inline key prefix plus index into the entry array ----
+struct sort_rec {
+    uint64_t key;
+    uint32_t idx;
+};
+
+// ---- uid/gid -> name cache (open addressing, filled on first lookup) ----
+struct id_slot {
+    unsigned int id;
+    char *name;             // NULL marks an empty slot
+};
+
+struct id_cache {
+    struct id_slot *slots;
+    size_t cap;             // power of two
+    size_t count;
+};
+
+// ---- mtime formatter: one localtime_r per distinct day, not per entry ----
+#define SIX_MONTHS (31556952 / 2)   // half an average Gregorian year, as GNU ls
+
+struct time_cache {
+    time_t lo, hi;          // [lo, hi) share one date and one UTC offset
+    int lo_secs;            // local seconds-since-midnight at lo
+    char date[32];          // "%b %e" (or "%b %e  %Y") for that day
+    int ready;
+};
+
+// ---- Snapshot (--snapshot / --diff): records in walk order, paths prefix-compressed ----
+struct snap_header {
+    char magic[8];
+    uint32_t rec_size;      // sizeof(struct snap_rec): guards layout changes
+    uint32_t reserved;
+};
+
+struct snap_rec {           // followed by 'suffix' path bytes
+    uint64_t ino;
+    int64_t size;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode;
+    uint32_t shared;        // bytes taken from the previous record's path
+    uint32_t suffix;
+};
+
+struct snapshot {
+    int active;
+    const char *root;           // walk root, stripped from recorded paths
+    struct outbuf out;          // --snapshot: temp file being written
+    char *tmp_name;
+    const char *out_name;
+    uint64_t written;
+    char *prev;                 // last path written (for prefix compression)
+    size_t prev_len, prev_cap;
+    const char *map;            // --diff: the old snapshot, mapped
+    size_t map_len, pos;
+    char *old;                  // current old record's path
+    size_t old_len, old_cap;
+    struct snap_rec old_rec;
+    int have_old;
+    char *cur;                  // scratch for the current record's path
+    size_t cur_cap;
+};
+
+// ---- Listing options (set once in main) ----
+enum sort_key { SORT_NAME, SORT_TIME, SORT_SIZE, SORT_VERSION };
+
+static int unsorted;        // -U/-f: stream entries in directory order
+static int show_all;        // -f: include dotfiles
+static enum sort_key sort_by = SORT_NAME;   // -t, -S, -v
+static int sort_reverse;    // -r
+static int use_collation;   // LC_COLLATE isn't C/POSIX: name order via strxfrm keys
+static int use_color = 1;   // --color policy, resolved against isatty() in main
+static int inode_order;     // stat entries in d_ino order (default for -l and -R)
+static int stat_jobs = 1;   // -j N without -R: threads that stat one directory
+
+// filters: name/type are checked on the getdents record, the rest after lstat
+static const char *filter_glob;         // --name: fnmatch() pattern
+static unsigned filter_types;           // --type: bit (1 << DT_*) per wanted type, 0 = any
+static off_t filter_min_size = -1;      // --min-size, -1 = unset
+static off_t filter_max_size = -1;      // --max-size, -1 = unset
+static struct timespec filter_newer;    // --newer FILE: its mtime
+static int filter_newer_set;
+static int filter_meta;                 // some filter needs the lstat
+
+static int top_n;           // --top N: only the first N of the -t/-S order
+static int du_mode;         // --du: per-directory size totals, printed after each subtree
+static int count_mode;      // --count: tally entries by d_type, print nothing per entry
+static int cache_fd = -1;   // --cache-dir: directory holding the listing indexes
+static int summary_only;    // --top/--count/--snapshot/--diff: no per-directory output
+static struct snapshot snap;
+
 // ---- Function Prototypes ----
+void out_flush(struct outbuf *ob);
+void out_write(struct outbuf *ob, const char *s, size_t len);
 void permissions_str(mode_t m, char *out);
-void print_long(const char *fullpath, const char *name);
-void print_default(char **names, int n, int maxlen, const char *basepath);
-void print_horizontal(char **names, int n, int maxlen, const char *basepath);
+const char *user_name(uid_t uid);
+const char *group_name(gid_t gid);
+void format_mtime(time_t t, char *out, size_t outsz);
+void print_long(struct outbuf *ob, int dirfd, const char *path,
+                const struct file_entry *fe);
+void print_default(struct outbuf *ob, struct file_entry *ents, int n, int maxlen);
+void print_horizontal(struct outbuf *ob, struct file_entry *ents, int n, int maxlen);
 int compare_names(const void *a, const void *b);
-const char *color_for_file(const char *fullpath, const char *name);
-void print_colored_padded(const char *basepath, const char *name, int pad_width);
+void sort_entries(struct dir_listing *ls);
+const char *color_for_file(const struct file_entry *fe);
+void print_colored_padded(struct outbuf *ob, const struct file_entry *fe, int pad_width);
 void do_ls(const char *path, int display_mode, int recursive_flag);
+int listing_add(struct dir_listing *ls, const char *name, unsigned char d_type,
+                ino_t d_ino);
+void listing_seal(struct dir_listing *ls);
+void listing_free(struct dir_listing *ls);
+int dir_open(struct dir_reader *dr, int fd);
+struct linux_dirent64 *dir_next(struct dir_reader *dr);
+void dir_close(struct dir_reader *dr);
+void stat_entries(int dirfd, struct file_entry *ents, int n, int display_mode);
+
+// ---- Buffered output ----
+static char stdout_data[OUTBUF_SIZE];
+static struct outbuf stdout_buf = { stdout_data, 0, sizeof(stdout_data), STDOUT_FILENO };
+
+/* write all of iov[0..cnt) to fd, riding out short writes and EINTR */
+static void write_all(int fd, struct iovec *iov, int cnt) {
+    while (cnt > 0) {
+        ssize_t w = writev(fd, iov, cnt);
+        if (w < 0) {
+            if (errno == EINTR) continue;
+            return;     // EPIPE etc.: nothing useful left to do with output
+        }
+        while (cnt > 0 && (size_t)w >= iov->iov_len) {
+            w -= iov->iov_len;
+            iov++;
+            cnt--;
+        }
+        if (cnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + w;
+            iov->iov_len -= w;
+        }
+    }
+}
+
+void out_flush(struct outbuf *ob) {
+    if (ob->fd < 0 || ob->len == 0) return;
+    struct iovec iov = { ob->data, ob->len };
+    write_all(ob->fd, &iov, 1);
+    ob->len = 0;
+}
+
+/* memory buffers grow; fd buffers flush, and hand huge chunks straight to writev */
+void out_write(struct outbuf *ob, const char *s, size_t len) {
+    if (len == 0) return;   // s may be NULL (an empty captured buffer)
+    if (ob->len + len > ob->cap) {
+        if (ob->fd >= 0) {
+            if (len >= ob->cap) {
+                struct iovec iov[2] = { { ob->data, ob->len }, { (void *)s, len } };
+                write_all(ob->fd, iov, 2);
+                ob->len = 0;
+                return;
+            }
+            out_flush(ob);
+        } else {
+            size_t ncap = ob->cap ? ob->cap * 2 : 4096;
+            while (ncap < ob->len + len) ncap *= 2;
+            char *nd = realloc(ob->data, ncap);
+            if (!nd) return;
+            ob->data = nd;
+            ob->cap = ncap;
+        }
+    }
+    memcpy(ob->data + ob->len, s, len);
+    ob->len += len;
+}
+
+static void out_str(struct outbuf *ob, const char *s) {
+    out_write(ob, s, strlen(s));
+}
+
+static void out_char(struct outbuf *ob, char c) {
+    if (ob->len < ob->cap) ob->data[ob->len++] = c;
+    else out_write(ob, &c, 1);
+}
+
+static void out_spaces(struct outbuf *ob, int n) {
+    static const char spaces[] = "                                ";
+    while (n > 0) {
+        int k = n < (int)sizeof(spaces) - 1 ? n : (int)sizeof(spaces) - 1;
+        out_write(ob, spaces, k);
+        n -= k;
+    }
+}
+
+/* like "%-*s" */
+static void out_str_left(struct outbuf *ob, const char *s, int width) {
+    size_t len = strlen(s);
+    out_write(ob, s, len);
+    if ((int)len < width) out_spaces(ob, width - (int)len);
+}
+
+/* like "%*lld" */
+static void out_num(struct outbuf *ob, long long v, int width) {
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long long u = v < 0 ? -(unsigned long long)v : (unsigned long long)v;
+    do {
+        *--p = '0' + u % 10;
+        u /= 10;
+    } while (u);
+    if (v < 0) *--p = '-';
+    int len = tmp + sizeof(tmp) - p;
+    if (len < width) out_spaces(ob, width - len);
+    out_write(ob, p, len);
+}
+
+/*
+ * Parallel -R workers set err_capture so their messages are kept with
+ * the directory's output and replayed in serial order.  Each record is
+ * the listing offset the message belongs at, its length, then the text.
+ */
+struct msg_capture {
+    struct outbuf *out;     // listing the messages are interleaved with
+    struct outbuf msgs;
+};
+
+static _Thread_local struct msg_capture *err_capture;
+
+static void capture_message(struct msg_capture *cap, const char *what,
+                            const char *what2, int err) {
+    const char *msg = strerror(err);
+    size_t rec[2];
+    rec[0] = cap->out->len;
+    rec[1] = strlen(what) + (what2 ? strlen(what2) + 1 : 0) + 2 + strlen(msg) + 1;
+    out_write(&cap->msgs, (const char *)rec, sizeof(rec));
+    out_str(&cap->msgs, what);
+    if (what2) {
+        out_char(&cap->msgs, '/');
+        out_str(&cap->msgs, what2);
+    }
+    out_write(&cap->msgs, ": ", 2);
+    out_str(&cap->msgs, msg);
+    out_char(&cap->msgs, '\n');
+}
+
+/* "what: strerror(err)\n" to stderr, or into the worker's capture buffer */
+static void report_error(const char *what, const char *what2, int err) {
+    if (err_capture) {
+        capture_message(err_capture, what, what2, err);
+        return;
+    }
+    // flush pending stdout first so messages stay in order with the listing
+    out_flush(&stdout_buf);
+    if (what2) fprintf(stderr, "%s/%s: %s\n", what, what2, strerror(err));
+    else fprintf(stderr, "%s: %s\n", what, strerror(err));
+}
+
+static void ls_perror(const char *s) {
+    report_error(s, NULL, errno);
+}
+
+// ---- Entry storage ----
+/* append a name to the arena and an entry to the index; -1 on ENOMEM */
+int listing_add(struct dir_listing *ls, const char *name, unsigned char d_type,
+                ino_t d_ino) {
+    size_t len = strlen(name);
+
+    if (ls->names_len + len + 1 > ls->names_cap) {
+        size_t ncap = ls->names_cap ? ls->names_cap * 2 : 64 * 1024;
+        while (ncap < ls->names_len + len + 1) ncap *= 2;
+        char *nb = realloc(ls->names, ncap);
+        if (!nb) return -1;
+        ls->names = nb;
+        ls->names_cap = ncap;
+    }
+    if (ls->n == ls->cap) {
+        int ncap = ls->cap ? ls->cap * 2 : 256;
+        struct file_entry *ne = realloc(ls->ents, ncap * sizeof(*ne));
+        if (!ne) return -1;
+        ls->ents = ne;
+        ls->cap = ncap;
+    }
+
+    struct file_entry *fe = &ls->ents[ls->n++];
+    fe->name = NULL;
+    fe->name_off = ls->names_len;
+    fe->d_type = d_type;
+    fe->d_ino = d_ino;
+    fe->stat_ok = 0;
+    fe->stat_errno = 0;
+    fe->hidden = 0;
+
+    memcpy(ls->names + ls->names_len, name, len + 1);
+    ls->names_len += len + 1;
+    if ((int)len > ls->maxlen) ls->maxlen = len;
+    return 0;
+}
+
+/* arena is final (no more reallocs): resolve name offsets to pointers */
+void listing_seal(struct dir_listing *ls) {
+    for (int i = 0; i < ls->n; ++i)
+        ls->ents[i].name = ls->names + ls->ents[i].name_off;
+}
+
+void listing_free(struct dir_listing *ls) {
+    free(ls->names);
+    free(ls->ents);
+    free(ls->du_dirs);
+    memset(ls, 0, sizeof(*ls));
+}
+
+// ---- Directory reader ----
+int dir_open(struct dir_reader *dr, int fd) {
+    dr->fd = fd;
+    dr->buf = malloc(DIRBUF_SIZE);
+    if (!dr->buf) return -1;
+    dr->len = dr->pos = 0;
+    dr->err = 0;
+    return 0;
+}
+
+/* return the next raw record, refilling the buffer as needed; NULL at end */
+struct linux_dirent64 *dir_next(struct dir_reader *dr) {
+    if (dr->pos >= dr->len) {
+        long nread = syscall(SYS_getdents64, dr->fd, dr->buf, DIRBUF_SIZE);
+        if (nread <= 0) {
+            if (nread < 0) dr->err = errno;
+            return NULL;
+        }
+        dr->len = nread;
+        dr->pos = 0;
+    }
+    struct linux_dirent64 *d = (struct linux_dirent64 *)(dr->buf + dr->pos);
+    dr->pos += d->d_reclen;
+    return d;
+}
+
+void dir_close(struct dir_reader *dr) {
+    free(dr->buf);
+    dr->buf = NULL;
+}
 
 // ---- Permission Helper ----
 void permissions_str(mode_t m, char *out) {
@@ -61,93 +499,699 @@ void permissions_str(mode_t m, char *out) {
     out[10] = '\0';
 }
 
-/* helper: case-insensitive suffix check */
-static int has_suffix(const char *name, const char *suf) {
-    size_t n = strlen(name), m = strlen(suf);
-    if (n < m) return 0;
-    return strncasecmp(name + n - m, suf, m) == 0;
+// ---- Colors ----
+static const char *type_color[CS_COUNT] = {
+    [CS_FILE] = COLOR_RESET,   [CS_DIR] = COLOR_BLUE,     [CS_LINK] = COLOR_MAGENTA,
+    [CS_FIFO] = COLOR_REVERSE, [CS_SOCK] = COLOR_REVERSE, [CS_BLK] = COLOR_REVERSE,
+    [CS_CHR] = COLOR_REVERSE,  [CS_EXEC] = COLOR_GREEN,
+};
+static struct suffix_trie suffixes;
+
+static size_t edge_slot(const struct suffix_trie *t, uint32_t key) {
+    size_t i = (key * 2654435761u) & (t->edge_cap - 1);
+    while (t->edge_key[i] && t->edge_key[i] != key)
+        i = (i + 1) & (t->edge_cap - 1);
+    return i;
 }
 
-/* choose color based on file type and extension */
-const char *color_for_file(const char *fullpath, const char *name) {
-    struct stat st;
-    if (lstat(fullpath, &st) < 0) return COLOR_RESET;
+static int trie_child(const struct suffix_trie *t, uint32_t node, unsigned char c) {
+    if (!t->edge_cap) return -1;
+    size_t i = edge_slot(t, node * 256 + c + 1);
+    return t->edge_key[i] ? (int)t->edge_child[i] : -1;
+}
+
+static int trie_grow_edges(struct suffix_trie *t) {
+    struct suffix_trie bigger = *t;
+    bigger.edge_cap = t->edge_cap ? t->edge_cap * 2 : 256;
+    bigger.edge_key = calloc(bigger.edge_cap, sizeof(*bigger.edge_key));
+    bigger.edge_child = malloc(bigger.edge_cap * sizeof(*bigger.edge_child));
+    if (!bigger.edge_key || !bigger.edge_child) {
+        free(bigger.edge_key);
+        free(bigger.edge_child);
+        return -1;
+    }
+    for (size_t i = 0; i < t->edge_cap; ++i) {
+        if (!t->edge_key[i]) continue;
+        size_t k = edge_slot(&bigger, t->edge_key[i]);
+        bigger.edge_key[k] = t->edge_key[i];
+        bigger.edge_child[k] = t->edge_child[i];
+    }
+    free(t->edge_key);
+    free(t->edge_child);
+    *t = bigger;
+    return 0;
+}
+
+static int trie_new_node(struct suffix_trie *t) {
+    if (t->nodes == t->node_cap) {
+        size_t ncap = t->node_cap ? t->node_cap * 2 : 64;
+        const char **nc = realloc(t->node_color, ncap * sizeof(*nc));
+        if (!nc) return -1;
+        t->node_color = nc;
+        t->node_cap = ncap;
+    }
+    t->node_color[t->nodes] = NULL;
+    return (int)t->nodes++;
+}
 
-    if (S_ISLNK(st.st_mode)) return COLOR_MAGENTA;
-    if (S_ISDIR(st.st_mode)) return COLOR_BLUE;
-    if (S_ISCHR(st.st_mode) || S_ISBLK(st.st_mode) ||
-        S_ISSOCK(st.st_mode) || S_ISFIFO(st.st_mode)) return COLOR_REVERSE;
+/* add rule "*sfx" -> escape; a later rule for the same suffix wins */
+static int trie_insert(struct suffix_trie *t, const char *sfx, const char *escape) {
+    if (t->nodes == 0 && trie_new_node(t) < 0) return -1;
+    uint32_t node = 0;
+    for (size_t i = strlen(sfx); i-- > 0; ) {
+        unsigned char c = tolower((unsigned char)sfx[i]);
+        int child = trie_child(t, node, c);
+        if (child < 0) {
+            if ((t->edge_count + 1) * 4 > t->edge_cap * 3 && trie_grow_edges(t) < 0)
+                return -1;
+            if ((child = trie_new_node(t)) < 0) return -1;
+            size_t k = edge_slot(t, node * 256 + c + 1);
+            t->edge_key[k] = node * 256 + c + 1;
+            t->edge_child[k] = child;
+            t->edge_count++;
+        }
+        node = child;
+    }
+    t->node_color[node] = escape;
+    return 0;
+}
 
-    if (has_suffix(name, ".tar") || has_suffix(name, ".tar.gz") ||
-        has_suffix(name, ".tgz") || has_suffix(name, ".gz") ||
-        has_suffix(name, ".zip") || has_suffix(name, ".bz2") ||
-        has_suffix(name, ".xz")) {
-        return COLOR_RED;
+/* color of the longest suffix rule matching 'name' (case-insensitive), or NULL */
+static const char *suffix_color(const char *name) {
+    const struct suffix_trie *t = &suffixes;
+    const char *best = NULL;
+    if (!t->nodes) return NULL;
+    uint32_t node = 0;
+    for (size_t i = strlen(name); i-- > 0; ) {
+        int child = trie_child(t, node, tolower((unsigned char)name[i]));
+        if (child < 0) break;
+        node = child;
+        if (t->node_color[node]) best = t->node_color[node];
     }
+    return best;
+}
 
-    if (st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)) return COLOR_GREEN;
+/* "01;34" -> "\033[01;34m", built once per rule */
+static const char *make_escape(const char *code) {
+    size_t len = strlen(code);
+    char *esc = malloc(len + 4);
+    if (!esc) return NULL;
+    memcpy(esc, "\033[", 2);
+    memcpy(esc + 2, code, len);
+    memcpy(esc + 2 + len, "m", 2);
+    return esc;
+}
 
-    return COLOR_RESET;
+/* only plain SGR codes ("01;34") are used; "ln=target" and the like are not */
+static int is_sgr_code(const char *code) {
+    if (!*code) return 0;
+    for (; *code; ++code)
+        if ((*code < '0' || *code > '9') && *code != ';') return 0;
+    return 1;
 }
 
-/* print a name padded, with color determined from basepath+name */
-void print_colored_padded(const char *basepath, const char *name, int pad_width) {
-    char full[PATH_MAX];
-    if (strcmp(basepath, ".") == 0)
-        snprintf(full, sizeof(full), "%s", name);
-    else
-        snprintf(full, sizeof(full), "%s/%s", basepath, name);
+/* type color slot for an LS_COLORS key, or -1 */
+static int color_key_slot(const char *key) {
+    static const struct { const char key[3]; enum color_slot slot; } keys[] = {
+        { "fi", CS_FILE }, { "di", CS_DIR }, { "ln", CS_LINK }, { "pi", CS_FIFO },
+        { "so", CS_SOCK }, { "bd", CS_BLK }, { "cd", CS_CHR }, { "ex", CS_EXEC },
+    };
+    for (size_t k = 0; k < sizeof(keys) / sizeof(keys[0]); ++k)
+        if (strcmp(key, keys[k].key) == 0) return keys[k].slot;
+    return -1;
+}
+
+/*
+ * Build the color tables once at startup.  Without LS_COLORS the
+ * built-in scheme applies (archives red by suffix).  With it, "xx=code"
+ * entries override the type colors (fi di ln pi so bd cd ex) and every
+ * "*sfx=code" entry goes into the suffix trie.  Everything else is
+ * ignored: codes that aren't plain SGR numbers (so "ln=target" leaves
+ * links in their own color), keys that would need a second stat of the
+ * entry or its target (or mi tw ow st su sg and the rest), and rs, since
+ * the reset sequence is fixed.
+ */
+static void colors_init(void) {
+    static const char *const archives[] = {
+        ".tar", ".tar.gz", ".tgz", ".gz", ".zip", ".bz2", ".xz",
+    };
+
+    const char *env = getenv("LS_COLORS");
+    if (!env || !*env) {
+        for (size_t i = 0; i < sizeof(archives) / sizeof(archives[0]); ++i)
+            trie_insert(&suffixes, archives[i], COLOR_RED);
+        return;
+    }
+
+    char *spec = strdup(env);
+    if (!spec) return;
+    char *save = NULL;
+    for (char *item = strtok_r(spec, ":", &save); item; item = strtok_r(NULL, ":", &save)) {
+        char *eq = strchr(item, '=');
+        if (!eq) continue;
+        *eq = '\0';
+        const char *code = eq + 1;
+        int slot = item[0] == '*' ? -1 : color_key_slot(item);
+        if (!is_sgr_code(code) || (item[0] == '*' ? !item[1] : slot < 0)) continue;
+
+        // allocate only for rules that are kept
+        const char *escape = make_escape(code);
+        if (!escape) break;
+        if (slot >= 0) type_color[slot] = escape;
+        else trie_insert(&suffixes, item + 1, escape);
+    }
+    free(spec);
+}
+
+/* file type of an entry: from the cached stat if we have one, else d_type */
+static unsigned char entry_type(const struct file_entry *fe) {
+    if (fe->stat_ok) return IFTODT(fe->st.st_mode);
+    return fe->d_type;
+}
+
+/*
+ * Does this entry need an lstat?  Long format, -t/-S, --du, snapshots
+ * and the size and time filters always do; a filtered-out directory or --count only
+ * for the type, except that -t/-S still sort filtered-out directories for -R.
+ * Otherwise only when d_type is unknown, or, with color on, for a
+ * regular file whose color depends on the executable bit.
+ */
+static int entry_needs_stat(const struct file_entry *fe, int display_mode) {
+    if (display_mode == STAT_EVERY) return 1;
+    int sort_stat = !unsorted && (sort_by == SORT_TIME || sort_by == SORT_SIZE);
+    if (fe->hidden) return fe->d_type == DT_UNKNOWN || sort_stat;   // only -R looks at it
+    if (count_mode) return fe->d_type == DT_UNKNOWN || filter_meta || du_mode;
+    if (display_mode == 1 || filter_meta || du_mode || snap.active || sort_stat) return 1;
+    if (fe->d_type == DT_UNKNOWN) return 1;
+    if (!use_color) return 0;
+    return fe->d_type == DT_REG && !suffix_color(fe->name);
+}
+
+/* choose color based on file type and suffix rules */
+const char *color_for_file(const struct file_entry *fe) {
+    unsigned char type = entry_type(fe);
+
+    if (type == DT_UNKNOWN) return COLOR_RESET;
+    if (type == DT_LNK) return type_color[CS_LINK];
+    if (type == DT_DIR) return type_color[CS_DIR];
+    if (type == DT_FIFO) return type_color[CS_FIFO];
+    if (type == DT_SOCK) return type_color[CS_SOCK];
+    if (type == DT_BLK) return type_color[CS_BLK];
+    if (type == DT_CHR) return type_color[CS_CHR];
+
+    const char *col = suffix_color(fe->name);
+    if (col) return col;
+
+    if (fe->stat_ok && (fe->st.st_mode & (S_IXUSR | S_IXGRP | S_IXOTH)))
+        return type_color[CS_EXEC];
+
+    return type_color[CS_FILE];
+}
+
+// ---- Batched stat ----
+static _Thread_local struct uring ring = { .fd = -1 };
+
+static void radix_sort_recs(struct sort_rec *a, struct sort_rec *tmp, size_t n);
 
-    const char *col = color_for_file(full, name);
-    printf("%s%-*s%s", col, pad_width, name, COLOR_RESET);
+static int uring_setup(struct uring *r) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    int fd = syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (fd < 0) return -1;
+
+    r->sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_sz > r->sq_ring_sz) r->sq_ring_sz = r->cq_ring_sz;
+        r->cq_ring_sz = r->sq_ring_sz;
+    }
+    r->sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    r->sq_ring = mmap(NULL, r->sq_ring_sz, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        r->cq_ring = r->sq_ring;
+    } else {
+        r->cq_ring = mmap(NULL, r->cq_ring_sz, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) goto fail_sq;
+    }
+    r->sqes = mmap(NULL, r->sqes_sz, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) goto fail_cq;
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_head  = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    r->entries  = p.sq_entries;
+    r->fd = fd;
+    return 0;
+
+fail_cq:
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+fail_sq:
+    munmap(r->sq_ring, r->sq_ring_sz);
+fail:
+    close(fd);
+    return -1;
+}
+
+static void uring_teardown(struct uring *r) {
+    if (r->fd < 0) return;
+    munmap(r->sqes, r->sqes_sz);
+    if (r->cq_ring != r->sq_ring) munmap(r->cq_ring, r->cq_ring_sz);
+    munmap(r->sq_ring, r->sq_ring_sz);
+    close(r->fd);
+    r->fd = -1;
+}
+
+static void statx_to_stat(const struct statx *sx, struct stat *st) {
+    memset(st, 0, sizeof(*st));
+    st->st_dev = makedev(sx->stx_dev_major, sx->stx_dev_minor);
+    st->st_ino = sx->stx_ino;
+    st->st_mode = sx->stx_mode;
+    st->st_nlink = sx->stx_nlink;
+    st->st_uid = sx->stx_uid;
+    st->st_gid = sx->stx_gid;
+    st->st_rdev = makedev(sx->stx_rdev_major, sx->stx_rdev_minor);
+    st->st_size = sx->stx_size;
+    st->st_blksize = sx->stx_blksize;
+    st->st_blocks = sx->stx_blocks;
+    st->st_atim.tv_sec = sx->stx_atime.tv_sec;
+    st->st_atim.tv_nsec = sx->stx_atime.tv_nsec;
+    st->st_mtim.tv_sec = sx->stx_mtime.tv_sec;
+    st->st_mtim.tv_nsec = sx->stx_mtime.tv_nsec;
+    st->st_ctim.tv_sec = sx->stx_ctime.tv_sec;
+    st->st_ctim.tv_nsec = sx->stx_ctime.tv_nsec;
+}
+
+static void stat_one(int dirfd, struct file_entry *fe) {
+    fe->stat_ok = (fstatat(dirfd, fe->name, &fe->st, AT_SYMLINK_NOFOLLOW) == 0);
+    fe->stat_errno = fe->stat_ok ? 0 : errno;
+}
+
+/*
+ * statx up to r->entries entries through the ring and wait for all of
+ * them.  If io_uring_enter fails, whatever already completed is kept and
+ * the rest are stat'ed with fstatat; returns -1 so the caller drops the ring.
+ */
+static int uring_stat_batch(struct uring *r, int dirfd, struct file_entry **batch,
+                            struct statx *sx, int count) {
+    unsigned tail = *r->sq_tail;
+    for (int i = 0; i < count; ++i) {
+        unsigned idx = tail & *r->sq_mask;
+        struct io_uring_sqe *sqe = &r->sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = IORING_OP_STATX;
+        sqe->fd = dirfd;
+        sqe->addr = (unsigned long)batch[i]->name;
+        sqe->len = STATX_BASIC_STATS;
+        sqe->off = (unsigned long)&sx[i];
+        sqe->statx_flags = AT_SYMLINK_NOFOLLOW;
+        sqe->user_data = i;
+        r->sq_array[idx] = idx;
+        tail++;
+    }
+    __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+
+    char done[URING_ENTRIES] = { 0 };
+    int submitted = 0, reaped = 0, failed = 0;
+    while (reaped < count && !failed) {
+        int ret = syscall(__NR_io_uring_enter, r->fd, count - submitted,
+                          count - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (ret < 0) {
+            if (errno == EINTR) continue;
+            failed = 1;     // still reap what is already in the CQ below
+        } else {
+            submitted += ret;
+        }
+
+        unsigned head = *r->cq_head;
+        unsigned ctail = __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+        for (; head != ctail; ++head, ++reaped) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            struct file_entry *fe = batch[cqe->user_data];
+            done[cqe->user_data] = 1;
+            if (cqe->res == 0) {
+                statx_to_stat(&sx[cqe->user_data], &fe->st);
+                fe->stat_ok = 1;
+                fe->stat_errno = 0;
+            } else if (cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) {
+                stat_one(dirfd, fe);    // kernel without IORING_OP_STATX
+            } else {
+                fe->stat_ok = 0;
+                fe->stat_errno = -cqe->res;
+            }
+        }
+        __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+    }
+    if (!failed) return 0;
+
+    for (int i = 0; i < count; ++i)
+        if (!done[i]) stat_one(dirfd, batch[i]);
+    return -1;
+}
+
+/* stat a run of entries through this thread's ring, or one fstatat each */
+static void stat_list(int dirfd, struct file_entry **list, int n) {
+    struct statx sx[URING_ENTRIES];
+
+    if (ring.fd == -1 && uring_setup(&ring) < 0) ring.fd = -2;
+
+    for (int i = 0; i < n; ) {
+        if (ring.fd < 0) {
+            stat_one(dirfd, list[i++]);
+            continue;
+        }
+        int count = n - i < (int)ring.entries ? n - i : (int)ring.entries;
+        if (uring_stat_batch(&ring, dirfd, list + i, sx, count) < 0) {
+            uring_teardown(&ring);
+            ring.fd = -2;   // batch is finished; the rest go through fstatat
+        }
+        i += count;
+    }
+}
+
+/* threads of one stat pool pull fixed-size chunks off a shared cursor */
+struct stat_pool {
+    int dirfd;
+    struct file_entry **list;
+    int n;
+    atomic_int next;
+};
+
+static void stat_pool_run(struct stat_pool *sp) {
+    int i;
+    while ((i = atomic_fetch_add(&sp->next, STAT_CHUNK)) < sp->n)
+        stat_list(sp->dirfd, sp->list + i, sp->n - i < STAT_CHUNK ? sp->n - i : STAT_CHUNK);
+}
+
+static void *stat_worker(void *arg) {
+    stat_pool_run(arg);
+    uring_teardown(&ring);
+    return NULL;
+}
+
+/*
+ * Fill the stat of every entry that needs one (see entry_needs_stat).
+ * With io_uring the whole directory is submitted in ring-sized batches
+ * so the filesystem can overlap inode reads; otherwise one fstatat each.
+ * With inode_order the entries are visited by ascending d_ino, so a
+ * cold inode table is read front to back instead of in name order.
+ * Large directories are split across stat_jobs threads (-j without -R),
+ * which hides per-call latency on NFS and FUSE.
+ */
+void stat_entries(int dirfd, struct file_entry *ents, int n, int display_mode) {
+    if (n == 0) return;
+
+    struct file_entry **list = malloc((size_t)n * sizeof(*list));
+    struct sort_rec *order = NULL;
+    int m = 0;
+
+    if (!list) {
+        // no room to plan: stat in directory order, one call each
+        for (int i = 0; i < n; ++i)
+            if (entry_needs_stat(&ents[i], display_mode)) stat_one(dirfd, &ents[i]);
+        return;
+    }
+
+    // if this allocation fails we just stat in directory order
+    if (inode_order && n > 1 && (order = malloc(2 * (size_t)n * sizeof(*order)))) {
+        for (int i = 0; i < n; ++i) {
+            if (!entry_needs_stat(&ents[i], display_mode)) continue;
+            order[m].key = ents[i].d_ino;
+            order[m].idx = i;
+            m++;
+        }
+        if (m > 1) radix_sort_recs(order, order + n, m);
+        for (int i = 0; i < m; ++i) list[i] = &ents[order[i].idx];
+        free(order);
+    } else {
+        for (int i = 0; i < n; ++i)
+            if (entry_needs_stat(&ents[i], display_mode)) list[m++] = &ents[i];
+    }
+
+    int nthreads = stat_jobs;
+    if (nthreads > (m + STAT_CHUNK - 1) / STAT_CHUNK) nthreads = (m + STAT_CHUNK - 1) / STAT_CHUNK;
+    if (m < STAT_POOL_MIN || nthreads < 2) {
+        stat_list(dirfd, list, m);
+        free(list);
+        return;
+    }
+
+    struct stat_pool sp = { dirfd, list, m, 0 };
+    pthread_t *tids = malloc((nthreads - 1) * sizeof(*tids));
+    int started = 0;
+    while (tids && started < nthreads - 1 &&
+           pthread_create(&tids[started], NULL, stat_worker, &sp) == 0)
+        started++;
+    stat_pool_run(&sp);     // this thread works too
+    for (int t = 0; t < started; ++t) pthread_join(tids[t], NULL);
+    free(tids);
+    free(list);
+}
+
+/* print a name padded, with color taken from the entry's cached stat */
+void print_colored_padded(struct outbuf *ob, const struct file_entry *fe, int pad_width) {
+    if (!use_color) {
+        out_str_left(ob, fe->name, pad_width);
+        return;
+    }
+    out_str(ob, color_for_file(fe));
+    out_str_left(ob, fe->name, pad_width);
+    out_str(ob, COLOR_RESET);
+}
+
+/* report an error for 'name' inside directory 'path', formatted like perror */
+static void entry_error(const char *path, const char *name, int err) {
+    if (strcmp(path, ".") == 0) report_error(name, NULL, err);
+    else report_error(path, name, err);
+}
+
+// ---- Owner / group names ----
+static struct id_cache user_cache, group_cache;
+static pthread_mutex_t id_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+static int numeric_ids;     // -n: print raw uid/gid, never consult NSS
+
+static size_t id_hash(unsigned int id, size_t cap) {
+    return (size_t)((id * 2654435761u) & (cap - 1));
+}
+
+static struct id_slot *id_cache_find(struct id_cache *c, unsigned int id) {
+    size_t i = id_hash(id, c->cap);
+    while (c->slots[i].name && c->slots[i].id != id)
+        i = (i + 1) & (c->cap - 1);
+    return &c->slots[i];
+}
+
+/* double the table once it is 3/4 full */
+static int id_cache_grow(struct id_cache *c) {
+    struct id_cache bigger = { NULL, c->cap ? c->cap * 2 : 64, 0 };
+    bigger.slots = calloc(bigger.cap, sizeof(*bigger.slots));
+    if (!bigger.slots) return -1;
+    for (size_t i = 0; i < c->cap; ++i) {
+        if (!c->slots[i].name) continue;
+        *id_cache_find(&bigger, c->slots[i].id) = c->slots[i];
+        bigger.count++;
+    }
+    free(c->slots);
+    *c = bigger;
+    return 0;
+}
+
+/*
+ * Look up 'id' in the cache, resolving it through NSS (or formatting it
+ * as a number under -n) the first time it is seen.  Caller holds
+ * id_cache_lock; getpwuid/getgrgid results are copied before it drops.
+ */
+static const char *id_cache_lookup_locked(struct id_cache *c, unsigned int id, int is_group) {
+    if (c->cap) {
+        struct id_slot *hit = id_cache_find(c, id);
+        if (hit->name) return hit->name;
+    }
+
+    char numbuf[16];
+    const char *resolved = NULL;
+    if (numeric_ids) {
+        snprintf(numbuf, sizeof(numbuf), "%u", id);
+        resolved = numbuf;
+    } else if (is_group) {
+        struct group *gr = getgrgid((gid_t)id);
+        if (gr) resolved = gr->gr_name;
+    } else {
+        struct passwd *pw = getpwuid((uid_t)id);
+        if (pw) resolved = pw->pw_name;
+    }
+    if (!resolved) resolved = "unknown";
+
+    if ((c->count + 1) * 4 > c->cap * 3 && id_cache_grow(c) < 0)
+        return "unknown";
+
+    struct id_slot *slot = id_cache_find(c, id);
+    slot->id = id;
+    slot->name = strdup(resolved);
+    if (!slot->name) return "unknown";
+    c->count++;
+    return slot->name;
+}
+
+/* cached names are never freed, so the pointer outlives the lock */
+static const char *id_cache_lookup(struct id_cache *c, unsigned int id, int is_group) {
+    pthread_mutex_lock(&id_cache_lock);
+    const char *name = id_cache_lookup_locked(c, id, is_group);
+    pthread_mutex_unlock(&id_cache_lock);
+    return name;
+}
+
+const char *user_name(uid_t uid) {
+    return id_cache_lookup(&user_cache, (unsigned int)uid, 0);
+}
+
+const char *group_name(gid_t gid) {
+    return id_cache_lookup(&group_cache, (unsigned int)gid, 1);
+}
+
+// ---- Modification time column ----
+static _Thread_local struct time_cache mtime_cache[2];   // [1]: the "old" format
+static time_t now_time;     // taken once, for the recent/old decision
+static pthread_once_t time_once = PTHREAD_ONCE_INIT;
+
+static void time_init(void) {
+    tzset();
+    now_time = time(NULL);
+}
+
+/* a long-running listing (-w) moves "now" forward between batches of rows */
+static void time_refresh(void) {
+    pthread_once(&time_once, time_init);
+    now_time = time(NULL);
+}
+
+static void time_cache_fill(struct time_cache *tc, time_t t, const struct tm *tm,
+                            const char *fmt) {
+    struct tm edge;
+    int day_secs = tm->tm_hour * 3600 + tm->tm_min * 60 + tm->tm_sec;
+    time_t lo = t - day_secs;
+    time_t last = lo + 86400 - 1;
+
+    tc->lo = lo;
+    tc->hi = lo + 86400;
+    tc->lo_secs = 0;
+
+    // a DST switch inside the day breaks the arithmetic: cache just the minute
+    if (!localtime_r(&lo, &edge) || edge.tm_gmtoff != tm->tm_gmtoff ||
+        !localtime_r(&last, &edge) || edge.tm_gmtoff != tm->tm_gmtoff) {
+        tc->lo = t - tm->tm_sec;
+        tc->hi = tc->lo + 60;
+        tc->lo_secs = day_secs - tm->tm_sec;
+    }
+
+    if (strftime(tc->date, sizeof(tc->date), fmt, tm) == 0) strcpy(tc->date, "??? ?? ????");
+    tc->ready = 1;
+}
+
+/*
+ * Format 't' like GNU ls: "Mon dd HH:MM" for the last six months,
+ * "Mon dd  YYYY" otherwise.  The timezone is loaded once; each format
+ * keeps its own per-day cache, so old files cost no localtime either,
+ * and hours/minutes are derived arithmetically.
+ * 'out' must hold at least 32 bytes (print_long passes 64).
+ */
+void format_mtime(time_t t, char *out, size_t outsz) {
+    pthread_once(&time_once, time_init);
+
+    int old = t < now_time - SIX_MONTHS || t > now_time;
+    struct time_cache *tc = &mtime_cache[old];
+    if (!tc->ready || t < tc->lo || t >= tc->hi) {
+        struct tm tm;
+        if (!localtime_r(&t, &tm)) {
+            snprintf(out, outsz, "??? ?? ????");
+            return;
+        }
+        time_cache_fill(tc, t, &tm, old ? "%b %e  %Y" : "%b %e");
+    }
+    if (old) {
+        memcpy(out, tc->date, strlen(tc->date) + 1);
+        return;
+    }
+
+    long secs = (long)(t - tc->lo) + tc->lo_secs;
+    int hh = secs / 3600, mm = (secs % 3600) / 60;
+    size_t dlen = strlen(tc->date);
+    memcpy(out, tc->date, dlen);
+    out += dlen;
+    *out++ = ' ';
+    *out++ = '0' + hh / 10;
+    *out++ = '0' + hh % 10;
+    *out++ = ':';
+    *out++ = '0' + mm / 10;
+    *out++ = '0' + mm % 10;
+    *out = '\0';
 }
 
 // ---- Long Listing ----
-void print_long(const char *fullpath, const char *name) {
-    struct stat st;
-    if (lstat(fullpath, &st) < 0) {
-        perror(fullpath);
+void print_long(struct outbuf *ob, int dirfd, const char *path,
+                const struct file_entry *fe) {
+    if (!fe->stat_ok) {
+        entry_error(path, fe->name, fe->stat_errno);
         return;
     }
 
-    char perm[12];
-    permissions_str(st.st_mode, perm);
+    const struct stat *stp = &fe->st;
+    const char *name = fe->name;
 
-    struct passwd *pw = getpwuid(st.st_uid);
-    struct group  *gr = getgrgid(st.st_gid);
+    char perm[12];
+    permissions_str(stp->st_mode, perm);
 
     char timebuf[64];
-    struct tm *tm = localtime(&st.st_mtime);
-    if (tm)
-        strftime(timebuf, sizeof(timebuf), "%b %e %H:%M", tm);
-    else
-        strncpy(timebuf, "??? ?? ????", sizeof(timebuf));
-
-    printf("%s %3lu %-8s %-8s %8lld %s ",
-           perm,
-           (unsigned long)st.st_nlink,
-           pw ? pw->pw_name : "unknown",
-           gr ? gr->gr_name : "unknown",
-           (long long)st.st_size,
-           timebuf);
-
-    const char *col = color_for_file(fullpath, name);
-    printf("%s%s%s", col, name, COLOR_RESET);
-
-    if (S_ISLNK(st.st_mode)) {
-        char target[PATH_MAX];
-        ssize_t tlen = readlink(fullpath, target, sizeof(target) - 1);
+    format_mtime(stp->st_mtime, timebuf, sizeof(timebuf));
+
+    // "%s %3lu %-8s %-8s %8lld %s "
+    out_write(ob, perm, 10);
+    out_char(ob, ' ');
+    out_num(ob, (long long)stp->st_nlink, 3);
+    out_char(ob, ' ');
+    out_str_left(ob, user_name(stp->st_uid), 8);
+    out_char(ob, ' ');
+    out_str_left(ob, group_name(stp->st_gid), 8);
+    out_char(ob, ' ');
+    out_num(ob, (long long)stp->st_size, 8);
+    out_char(ob, ' ');
+    out_str(ob, timebuf);
+    out_char(ob, ' ');
+
+    if (use_color) {
+        out_str(ob, color_for_file(fe));
+        out_str(ob, name);
+        out_str(ob, COLOR_RESET);
+    } else {
+        out_str(ob, name);
+    }
+
+    if (S_ISLNK(stp->st_mode)) {
+        // st_size of a symlink is its target length (0 on some pseudo fs)
+        size_t cap = stp->st_size > 0 ? (size_t)stp->st_size + 1 : PATH_MAX;
+        char *target = malloc(cap);
+        ssize_t tlen = target ? readlinkat(dirfd, name, target, cap - 1) : -1;
         if (tlen >= 0) {
-            target[tlen] = '\0';
-            printf(" -> %s", target);
+            out_write(ob, " -> ", 4);
+            out_write(ob, target, tlen);
         }
+        free(target);
     }
 
-    printf("\n");
+    out_char(ob, '\n');
 }
 
 // ---- Default Column Display (down then across) ----
-void print_default(char **names, int n, int maxlen, const char *basepath) {
+void print_default(struct outbuf *ob, struct file_entry *ents, int n, int maxlen) {
     struct winsize ws;
     int term_width = 80;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
@@ -162,14 +1206,14 @@ void print_default(char **names, int n, int maxlen, const char *basepath) {
         for (int c = 0; c < cols; ++c) {
             int i = c * rows + r;
             if (i < n)
-                print_colored_padded(basepath, names[i], col_width);
+                print_colored_padded(ob, &ents[i], col_width);
         }
-        printf("\n");
+        out_char(ob, '\n');
     }
 }
 
 // ---- Horizontal (row-major) Display ----
-void print_horizontal(char **names, int n, int maxlen, const char *basepath) {
+void print_horizontal(struct outbuf *ob, struct file_entry *ents, int n, int maxlen) {
     struct winsize ws;
     int term_width = 80;
     if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col > 0)
@@ -180,117 +1224,2385 @@ void print_horizontal(char **names, int n, int maxlen, const char *basepath) {
 
     for (int i = 0; i < n; ++i) {
         if (current_width + col_width > term_width) {
-            printf("\n");
+            out_char(ob, '\n');
             current_width = 0;
         }
 
-        print_colored_padded(basepath, names[i], col_width);
+        print_colored_padded(ob, &ents[i], col_width);
         current_width += col_width;
     }
-    printf("\n");
+    out_char(ob, '\n');
 }
 
 // ---- Comparison function for qsort ----
 int compare_names(const void *a, const void *b) {
-    const char *s1 = *(const char **)a;
-    const char *s2 = *(const char **)b;
-    return strcmp(s1, s2);
+    const struct file_entry *e1 = a;
+    const struct file_entry *e2 = b;
+    return strcmp(e1->name, e2->name);
 }
 
-/*
- * do_ls: list directory 'path'. display_mode: 0=default,1=-l,2=-x.
- * If recursive_flag is non-zero, descend into subdirectories.
- */
-void do_ls(const char *path, int display_mode, int recursive_flag) {
-    DIR *dp = opendir(path);
-    if (!dp) {
-        perror(path);
-        return;
+// ---- Sorting: radix sort of compact (key prefix, index) records ----
+#define RADIX_MIN 64        // below this, plain qsort is cheaper for names
+
+/* first 8 key bytes, big-endian and zero padded: compares like strcmp */
+static uint64_t name_prefix(const char *name) {
+    uint64_t k = 0;
+    for (int i = 0, j = 0; i < 8; ++i) {
+        unsigned char c = name[j];
+        k = (k << 8) | c;
+        if (c) j++;
     }
+    return k;
+}
 
-    // Print directory header (ls -R prints headers)
-    printf("%s:\n", path);
+/* LSD radix sort on the 64-bit key, skipping bytes all keys share */
+static void radix_sort_recs(struct sort_rec *a, struct sort_rec *tmp, size_t n) {
+    struct sort_rec *src = a, *dst = tmp;
+    for (int shift = 0; shift < 64; shift += 8) {
+        size_t count[256] = { 0 };
+        for (size_t i = 0; i < n; ++i) count[(src[i].key >> shift) & 0xff]++;
+        if (count[(src[0].key >> shift) & 0xff] == n) continue;
 
-    struct dirent *entry;
-    char *names[4096];
-    int n = 0, maxlen = 0;
+        size_t sum = 0;
+        for (int b = 0; b < 256; ++b) {
+            size_t c = count[b];
+            count[b] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; ++i)
+            dst[count[(src[i].key >> shift) & 0xff]++] = src[i];
 
-    // Collect entries (skip hidden)
-    while ((entry = readdir(dp)) != NULL) {
-        if (entry->d_name[0] == '.') continue;
-        if (n >= (int)(sizeof(names)/sizeof(names[0]))) break;
-        names[n] = strdup(entry->d_name);
-        if (!names[n]) { perror("strdup"); break; }
-        int len = strlen(names[n]);
-        if (len > maxlen) maxlen = len;
-        n++;
+        struct sort_rec *t = src;
+        src = dst;
+        dst = t;
     }
-    closedir(dp);
-
-    // Sort
-    if (n > 1) qsort(names, n, sizeof(char *), compare_names);
+    if (src != a) memcpy(a, src, n * sizeof(*a));
+}
 
-    // Display according to mode
-    if (display_mode == 1) {
-        for (int i = 0; i < n; ++i) {
-            char full[PATH_MAX];
-            if (strcmp(path, ".") == 0) snprintf(full, sizeof(full), "%s", names[i]);
-            else snprintf(full, sizeof(full), "%s/%s", path, names[i]);
-            print_long(full, names[i]);
+/*
+ * Version-sort key (-v): digit runs become '0', (length + 1), digits
+ * without leading zeros; everything else is copied.  A plain byte
+ * compare of two keys then orders "file9" before "file10".
+ */
+static size_t version_key(const char *name, char *out) {
+    size_t o = 0;
+    while (*name) {
+        if (*name < '0' || *name > '9') {
+            out[o++] = *name++;
+            continue;
+        }
+        while (*name == '0') name++;
+        size_t len = 0;
+        while (name[len] >= '0' && name[len] <= '9') len++;
+        if (len > 254) len = 254;   // absurdly long runs continue as a new run
+        out[o++] = '0';
+        out[o++] = (char)(len + 1);
+        memcpy(out + o, name, len);
+        o += len;
+        name += len;
+    }
+    out[o++] = '\0';
+    return o;
+}
+
+/*
+ * Append the strxfrm() collation key of 'name' to the key buffer,
+ * growing it as needed; returns the key's offset or (size_t)-1.
+ * strcmp() on two such keys orders like strcoll() on the names.
+ */
+static size_t collate_key(const char *name, char **buf, size_t *len, size_t *cap) {
+    for (;;) {
+        size_t room = *cap - *len;
+        size_t need = strxfrm(*buf + *len, name, room);
+        if (need < room) {
+            size_t off = *len;
+            *len += need + 1;
+            return off;
+        }
+        size_t ncap = *cap * 2;
+        while (ncap - *len <= need) ncap *= 2;
+        char *nb = realloc(*buf, ncap);
+        if (!nb) return (size_t)-1;
+        *buf = nb;
+        *cap = ncap;
+    }
+}
+
+struct sort_ctx {
+    const struct file_entry *ents;
+    const char *keys;           // version (-v) or collation keys, else NULL
+    const size_t *key_off;
+};
+
+/* ordering of records whose 8-byte prefixes are equal */
+static int compare_ties(const void *a, const void *b, void *arg) {
+    const struct sort_ctx *ctx = arg;
+    const struct sort_rec *r1 = a, *r2 = b;
+    const char *n1 = ctx->ents[r1->idx].name, *n2 = ctx->ents[r2->idx].name;
+
+    if (ctx->keys) {
+        if (r1->key & 0xff) {
+            int c = strcmp(ctx->keys + ctx->key_off[r1->idx] + 8,
+                           ctx->keys + ctx->key_off[r2->idx] + 8);
+            if (c) return c;
+        }
+    } else if (sort_by == SORT_NAME) {
+        return strcmp(n1 + 8, n2 + 8);
+    }
+    return strcmp(n1, n2);      // -t/-S ties (and equal keys) go by name
+}
+
+/* signed 64-bit value as an unsigned key with the same order */
+static uint64_t signed_key(int64_t v) {
+    return (uint64_t)v ^ (1ULL << 63);
+}
+
+/*
+ * Sort a listing by the current sort key.  Each entry becomes a 16-byte
+ * record holding its key inline (the first 8 name or version-key bytes,
+ * or the mtime/size), extracted once up front, so the radix passes never
+ * touch the entries; only runs of equal keys fall back to comparing
+ * names.  The entries are then permuted once into the sorted order.
+ */
+void sort_entries(struct dir_listing *ls) {
+    size_t n = ls->n;
+    if (n < 2) return;
+    int collate = (sort_by == SORT_NAME && use_collation);
+    if (n < RADIX_MIN && sort_by == SORT_NAME && !collate) {
+        qsort(ls->ents, n, sizeof(ls->ents[0]), compare_names);
+        goto reverse;
+    }
+
+    struct sort_rec *recs = malloc(2 * n * sizeof(*recs));
+    struct file_entry *sorted = malloc(n * sizeof(*sorted));
+    struct sort_ctx ctx = { ls->ents, NULL, NULL };
+    char *vkeys = NULL;
+    size_t *voff = NULL;
+    size_t vlen = 0, vcap = 0;
+    if (sort_by == SORT_VERSION || collate) {
+        // a version key is at most twice its name plus NUL ("1.1" -> 8 bytes
+        // from 4: every 1-digit run becomes 3); collation keys grow on
+        // demand from a guess of 4x
+        vcap = collate ? ls->names_len * 4 + 64 : ls->names_len * 2;
+        vkeys = malloc(vcap);
+        voff = malloc(n * sizeof(*voff));
+    }
+    if (!recs || !sorted || ((sort_by == SORT_VERSION || collate) && (!vkeys || !voff))) {
+        ls_perror("malloc");
+        free(recs);
+        free(sorted);
+        free(vkeys);
+        free(voff);
+        return;
+    }
+
+    for (size_t i = 0; i < n; ++i) {
+        const struct file_entry *fe = &ls->ents[i];
+        switch (sort_by) {
+        case SORT_TIME: {
+            // entries without a stat sort as mtime 0; their st is garbage
+            int64_t ns = fe->stat_ok ? (int64_t)fe->st.st_mtim.tv_sec * 1000000000 +
+                                       fe->st.st_mtim.tv_nsec : 0;
+            recs[i].key = ~signed_key(ns);          // newest first
+            break;
+        }
+        case SORT_SIZE:
+            recs[i].key = ~signed_key(fe->stat_ok ? fe->st.st_size : 0);  // largest first
+            break;
+        case SORT_VERSION:
+            voff[i] = vlen;
+            vlen += version_key(fe->name, vkeys + vlen);
+            recs[i].key = name_prefix(vkeys + voff[i]);
+            break;
+        default:
+            if (collate) {
+                voff[i] = collate_key(fe->name, &vkeys, &vlen, &vcap);
+                if (voff[i] == (size_t)-1) {
+                    // out of memory: fall back to byte order
+                    ls_perror("malloc");
+                    free(recs);
+                    free(sorted);
+                    free(vkeys);
+                    free(voff);
+                    qsort(ls->ents, n, sizeof(ls->ents[0]), compare_names);
+                    goto reverse;
+                }
+                recs[i].key = name_prefix(vkeys + voff[i]);
+            } else {
+                recs[i].key = name_prefix(fe->name);
+            }
+            break;
+        }
+        recs[i].idx = i;
+    }
+    ctx.keys = vkeys;
+    ctx.key_off = voff;
+    radix_sort_recs(recs, recs + n, n);
+
+    // Break ties; for raw names, equal prefixes without a full 8th byte are equal names
+    for (size_t i = 0; i < n; ) {
+        size_t j = i + 1;
+        while (j < n && recs[j].key == recs[i].key) j++;
+        if (j - i > 1 && (sort_by != SORT_NAME || vkeys || (recs[i].key & 0xff)))
+            qsort_r(recs + i, j - i, sizeof(*recs), compare_ties, &ctx);
+        i = j;
+    }
+
+    for (size_t i = 0; i < n; ++i) sorted[i] = ls->ents[recs[i].idx];
+    free(ls->ents);
+    ls->ents = sorted;
+    ls->cap = n;
+    free(recs);
+    free(vkeys);
+    free(voff);
+
+reverse:
+    if (sort_reverse) {
+        for (size_t i = 0, j = n - 1; i < j; ++i, --j) {
+            struct file_entry t = ls->ents[i];
+            ls->ents[i] = ls->ents[j];
+            ls->ents[j] = t;
+        }
+    }
+}
+
+/* malloc "path/name" (or just "name" when listing "."); no length limit */
+static char *join_path(const char *path, const char *name) {
+    if (strcmp(path, ".") == 0) return strdup(name);
+    size_t plen = strlen(path), nlen = strlen(name);
+    char *out = malloc(plen + nlen + 2);
+    if (!out) return NULL;
+    memcpy(out, path, plen);
+    out[plen] = '/';
+    memcpy(out + plen + 1, name, nlen + 1);
+    return out;
+}
+
+/* should -R descend into this entry? */
+static int is_subdir(const struct file_entry *fe) {
+    if (entry_type(fe) != DT_DIR) return 0;
+    // skip . and .. (we already filtered hidden, but just in case)
+    return strcmp(fe->name, ".") != 0 && strcmp(fe->name, "..") != 0;
+}
+
+static int skip_name(const char *name) {
+    return name[0] == '.' && !show_all;
+}
+
+/* name and type filters, on what getdents gave us (before any lstat) */
+static int filter_name_type(const char *name, unsigned char d_type) {
+    if (filter_glob && fnmatch(filter_glob, name, 0) != 0) return 0;
+    if (filter_types && d_type != DT_UNKNOWN && !(filter_types & (1u << d_type))) return 0;
+    return 1;
+}
+
+/* filters that need the lstat; an entry whose lstat failed is kept so the error shows */
+static int filter_stat(const struct file_entry *fe) {
+    if (filter_types && !(filter_types & (1u << entry_type(fe)))) return 0;
+    if (!filter_meta || !fe->stat_ok) return 1;
+    if (filter_min_size >= 0 && fe->st.st_size < filter_min_size) return 0;
+    if (filter_max_size >= 0 && fe->st.st_size > filter_max_size) return 0;
+    if (filter_newer_set &&
+        (fe->st.st_mtim.tv_sec < filter_newer.tv_sec ||
+         (fe->st.st_mtim.tv_sec == filter_newer.tv_sec &&
+          fe->st.st_mtim.tv_nsec <= filter_newer.tv_nsec)))
+        return 0;
+    return 1;
+}
+
+/*
+ * Apply filter_stat to a stat'ed listing before it is sorted.  Losers
+ * are dropped, except directories under -R, which stay hidden so the
+ * walk still reaches matches below them.  Returns the number hidden.
+ */
+static int filter_listing(struct dir_listing *ls, int recursive_flag) {
+    int kept = 0, nhidden = 0;
+    ls->maxlen = 0;
+    for (int i = 0; i < ls->n; ++i) {
+        struct file_entry *fe = &ls->ents[i];
+        if (!fe->hidden && !filter_stat(fe)) fe->hidden = 1;
+        if (fe->hidden) {
+            if (!recursive_flag || !is_subdir(fe)) continue;
+            nhidden++;
+        } else if ((int)strlen(fe->name) > ls->maxlen) {
+            ls->maxlen = strlen(fe->name);
+        }
+        ls->ents[kept++] = *fe;
+    }
+    ls->n = kept;
+    return nhidden;
+}
+
+// ---- Disk usage (--du): per-directory totals, hardlinks counted once ----
+struct inode_set {
+    uint64_t *keys;     // (dev, ino) pairs; ino 0 marks a free slot
+    size_t cap;         // in pairs, power of two
+    size_t n;
+};
+
+static struct inode_set du_seen;
+
+static size_t inode_hash(uint64_t dev, uint64_t ino, size_t cap) {
+    uint64_t h = (ino ^ (dev * 0x9e3779b97f4a7c15ULL)) * 0xff51afd7ed558ccdULL;
+    return (h ^ (h >> 32)) & (cap - 1);
+}
+
+static int inode_set_grow(struct inode_set *s) {
+    size_t ncap = s->cap ? s->cap * 2 : 1024;
+    uint64_t *nk = calloc(ncap, 2 * sizeof(*nk));
+    if (!nk) return -1;
+    for (size_t i = 0; i < s->cap; ++i) {
+        if (!s->keys[2 * i + 1]) continue;
+        size_t j = inode_hash(s->keys[2 * i], s->keys[2 * i + 1], ncap);
+        while (nk[2 * j + 1]) j = (j + 1) & (ncap - 1);
+        nk[2 * j] = s->keys[2 * i];
+        nk[2 * j + 1] = s->keys[2 * i + 1];
+    }
+    free(s->keys);
+    s->keys = nk;
+    s->cap = ncap;
+    return 0;
+}
+
+/* 1 if (dev, ino) is new, 0 if already seen, -1 if the set can't grow */
+static int inode_set_insert(struct inode_set *s, uint64_t dev, uint64_t ino) {
+    if (2 * (s->n + 1) > s->cap && inode_set_grow(s) < 0) return -1;
+    size_t i = inode_hash(dev, ino, s->cap);
+    while (s->keys[2 * i + 1]) {
+        if (s->keys[2 * i] == dev && s->keys[2 * i + 1] == ino) return 0;
+        i = (i + 1) & (s->cap - 1);
+    }
+    s->keys[2 * i] = dev;
+    s->keys[2 * i + 1] = ino;
+    s->n++;
+    return 1;
+}
+
+/* count an entry toward its directory; a hardlinked file only the first time */
+static void du_add(struct dir_listing *ls, const struct file_entry *fe) {
+    if (!fe->stat_ok || strcmp(fe->name, ".") == 0 || strcmp(fe->name, "..") == 0) return;
+    const struct stat *st = &fe->st;
+    // a directory's nlink counts its subdirectories, not hardlinks
+    if (st->st_nlink > 1 && !S_ISDIR(st->st_mode) &&
+        inode_set_insert(&du_seen, st->st_dev, st->st_ino) == 0)
+        return;
+    ls->du_bytes += st->st_size;
+    ls->du_blocks += st->st_blocks;
+}
+
+/*
+ * Totals don't depend on what is shown: an entry the listing drops (a
+ * dotfile without -a, or one the filters reject) is lstat'ed here if it
+ * wasn't already and counted.  Under -R a dropped directory goes to
+ * ls->du_dirs instead, for the walk to total without listing it.
+ */
+static void du_add_dropped(struct dir_listing *ls, int dirfd, struct file_entry *fe,
+                           int recursive_flag) {
+    if (strcmp(fe->name, ".") == 0 || strcmp(fe->name, "..") == 0) return;
+    if (!fe->stat_ok && !fe->stat_errno) stat_one(dirfd, fe);
+    if (!recursive_flag || !fe->stat_ok || !S_ISDIR(fe->st.st_mode)) {
+        du_add(ls, fe);
+        return;
+    }
+
+    size_t nlen = strlen(fe->name) + 1;
+    if (ls->du_dirs_len + nlen > ls->du_dirs_cap) {
+        size_t ncap = ls->du_dirs_cap ? ls->du_dirs_cap * 2 : 256;
+        while (ncap < ls->du_dirs_len + nlen) ncap *= 2;
+        char *nb = realloc(ls->du_dirs, ncap);
+        if (!nb) {
+            ls_perror("malloc");
+            return;
+        }
+        ls->du_dirs = nb;
+        ls->du_dirs_cap = ncap;
+    }
+    memcpy(ls->du_dirs + ls->du_dirs_len, fe->name, nlen);
+    ls->du_dirs_len += nlen;
+}
+
+/* --du for a getdents record the read loop skips */
+static void du_skip_dirent(struct dir_listing *ls, int dirfd, struct linux_dirent64 *d,
+                           int recursive_flag) {
+    struct file_entry fe = { 0 };
+    fe.name = d->d_name;
+    fe.d_type = d->d_type;
+    du_add_dropped(ls, dirfd, &fe, recursive_flag);
+}
+
+/* a walked directory's own inode (its listing entry in the parent isn't counted) */
+static void du_add_dir(int dirfd, uint64_t *bytes, uint64_t *blocks) {
+    struct stat st;
+    if (fstat(dirfd, &st) < 0) return;
+    *bytes += st.st_size;
+    *blocks += st.st_blocks;
+}
+
+/* "total for PATH: N bytes apparent, MK allocated" (1K blocks, rounded up, like du) */
+static void du_print(struct outbuf *ob, const char *path, uint64_t bytes, uint64_t blocks) {
+    out_str(ob, "total for ");
+    out_str(ob, path);
+    out_write(ob, ": ", 2);
+    out_num(ob, (long long)bytes, 0);
+    out_str(ob, " bytes apparent, ");
+    out_num(ob, (long long)((blocks + 1) / 2), 0);
+    out_str(ob, "K allocated\n");
+}
+
+// ---- Top-K (--top N): bounded heap of the best entries seen so far ----
+struct top_heap {
+    struct file_entry *ents;    // heap ordered so the entry that lists last is at [0]
+    int n, cap;                 // cap grows on demand up to top_n
+    char *scratch;              // candidate's display name, built before admission
+    size_t scratch_cap;
+    const char *root;           // -R walk root, stripped from the names
+};
+
+static struct top_heap top;
+
+/* <0 if a lists before b under -t/-S (and -r); ties by name, like sort_entries */
+static int top_cmp(const struct file_entry *a, const struct file_entry *b) {
+    int c = 0;
+    if (sort_by == SORT_SIZE) {
+        if (a->st.st_size != b->st.st_size) c = a->st.st_size > b->st.st_size ? -1 : 1;
+    } else if (a->st.st_mtim.tv_sec != b->st.st_mtim.tv_sec) {
+        c = a->st.st_mtim.tv_sec > b->st.st_mtim.tv_sec ? -1 : 1;
+    } else if (a->st.st_mtim.tv_nsec != b->st.st_mtim.tv_nsec) {
+        c = a->st.st_mtim.tv_nsec > b->st.st_mtim.tv_nsec ? -1 : 1;
+    }
+    if (c == 0) c = strcmp(a->name, b->name);
+    return sort_reverse ? -c : c;
+}
+
+static void top_sift_down(int i) {
+    struct file_entry *h = top.ents;
+    for (;;) {
+        int l = 2 * i + 1, r = l + 1, m = i;
+        if (l < top.n && top_cmp(&h[l], &h[m]) > 0) m = l;
+        if (r < top.n && top_cmp(&h[r], &h[m]) > 0) m = r;
+        if (m == i) return;
+        struct file_entry t = h[i];
+        h[i] = h[m];
+        h[m] = t;
+        i = m;
+    }
+}
+
+/*
+ * Offer a stat'ed entry.  'dir' is its directory's display path under
+ * -R (names become "dir/name" relative to the walk root) or NULL.
+ * Memory stays O(top_n).
+ */
+static void top_offer(const struct file_entry *fe, const char *dir) {
+    struct file_entry cand = *fe;
+
+    if (dir && strcmp(dir, top.root) == 0)
+        dir = NULL;
+    else if (dir && strcmp(top.root, ".") != 0)
+        dir += strlen(top.root) + 1;
+    if (dir) {
+        size_t dlen = strlen(dir), nlen = strlen(fe->name);
+        if (dlen + nlen + 2 > top.scratch_cap) {
+            size_t ncap = (dlen + nlen + 2) * 2;
+            char *nb = realloc(top.scratch, ncap);
+            if (!nb) {
+                ls_perror("malloc");
+                return;
+            }
+            top.scratch = nb;
+            top.scratch_cap = ncap;
+        }
+        memcpy(top.scratch, dir, dlen);
+        top.scratch[dlen] = '/';
+        memcpy(top.scratch + dlen + 1, fe->name, nlen + 1);
+        cand.name = top.scratch;
+    }
+
+    if (top.n == top_n && top_cmp(&cand, &top.ents[0]) >= 0) return;
+
+    if (top.n == top.cap && top.n < top_n) {
+        int ncap = top.cap ? top.cap * 2 : 64;
+        if (ncap > top_n) ncap = top_n;
+        struct file_entry *ne = realloc(top.ents, ncap * sizeof(*ne));
+        if (!ne) {
+            ls_perror("malloc");
+            return;
+        }
+        top.ents = ne;
+        top.cap = ncap;
+    }
+
+    char *name = strdup(cand.name);
+    if (!name) {
+        ls_perror("malloc");
+        return;
+    }
+    cand.name = name;
+
+    if (top.n < top_n) {
+        // sift up from the new leaf
+        int i = top.n++;
+        while (i > 0 && top_cmp(&cand, &top.ents[(i - 1) / 2]) > 0) {
+            top.ents[i] = top.ents[(i - 1) / 2];
+            i = (i - 1) / 2;
+        }
+        top.ents[i] = cand;
+    } else {
+        free((char *)top.ents[0].name);
+        top.ents[0] = cand;
+        top_sift_down(0);
+    }
+}
+
+static int top_sort_cmp(const void *a, const void *b) {
+    return top_cmp(a, b);
+}
+
+/* print the winners under one 'path:' header; names are relative to dirfd */
+static void top_render(struct outbuf *ob, int dirfd, const char *path, int display_mode) {
+    int maxlen = 0;
+
+    if (top.n > 1) qsort(top.ents, top.n, sizeof(top.ents[0]), top_sort_cmp);
+    for (int i = 0; i < top.n; ++i)
+        if ((int)strlen(top.ents[i].name) > maxlen) maxlen = strlen(top.ents[i].name);
+
+    out_str(ob, path);
+    out_write(ob, ":\n", 2);
+    if (display_mode == 1) {
+        for (int i = 0; i < top.n; ++i)
+            print_long(ob, dirfd, path, &top.ents[i]);
+    } else if (display_mode == 2) {
+        print_horizontal(ob, top.ents, top.n, maxlen);
+    } else {
+        print_default(ob, top.ents, top.n, maxlen);
+    }
+
+    for (int i = 0; i < top.n; ++i) free((char *)top.ents[i].name);
+    free(top.ents);
+    free(top.scratch);
+    memset(&top, 0, sizeof(top));
+}
+
+// ---- Entry count (--count): per-type tallies straight from getdents ----
+static unsigned long long type_count[16];   // indexed by DT_*
+
+/* one right-aligned "count type" line per type seen, then the total */
+static void count_render(struct outbuf *ob, const char *path) {
+    static const struct { unsigned char type; const char *label; } kinds[] = {
+        { DT_REG, "file" }, { DT_DIR, "directory" }, { DT_LNK, "symlink" },
+        { DT_FIFO, "fifo" }, { DT_SOCK, "socket" }, { DT_BLK, "block device" },
+        { DT_CHR, "char device" }, { DT_UNKNOWN, "unknown" },
+    };
+    unsigned long long total = 0;
+
+    out_str(ob, path);
+    out_write(ob, ":\n", 2);
+    for (size_t i = 0; i < sizeof(kinds) / sizeof(kinds[0]); ++i) {
+        unsigned long long c = type_count[kinds[i].type];
+        total += c;
+        if (!c) continue;
+        out_num(ob, (long long)c, 10);
+        out_char(ob, ' ');
+        out_str(ob, kinds[i].label);
+        out_char(ob, '\n');
+    }
+    out_num(ob, (long long)total, 10);
+    out_str(ob, " total\n");
+}
+
+/*
+ * Unsorted mode: print each entry as getdents hands it over, one per
+ * line, flushing after every getdents buffer so output starts at once.
+ * Only subdirectories (for -R) and --du totals are kept in 'subdirs'; memory stays
+ * constant in the directory size.  With --top the entries go to the
+ * heap instead of the output; --count only bumps type_count.
+ */
+static void stream_entries(struct outbuf *ob, struct dir_reader *dr, int dirfd,
+                           const char *path, int display_mode, int recursive_flag,
+                           struct dir_listing *subdirs) {
+    struct linux_dirent64 *entry;
+
+    while ((entry = dir_next(dr)) != NULL) {
+        if (skip_name(entry->d_name)) {
+            if (du_mode) du_skip_dirent(subdirs, dirfd, entry, recursive_flag);
+            continue;
+        }
+
+        struct file_entry fe = { 0 };
+        fe.name = entry->d_name;
+        fe.d_type = entry->d_type;
+        fe.hidden = !filter_name_type(fe.name, fe.d_type);
+        if (fe.hidden && !(recursive_flag && (fe.d_type == DT_DIR || fe.d_type == DT_UNKNOWN))) {
+            if (du_mode) du_add_dropped(subdirs, dirfd, &fe, recursive_flag);
+            continue;
+        }
+        if (entry_needs_stat(&fe, display_mode)) stat_one(dirfd, &fe);
+        if (!fe.hidden && !filter_stat(&fe)) fe.hidden = 1;
+        // a hidden directory is still walked under -R and totals itself there
+        if (du_mode && !(recursive_flag && is_subdir(&fe))) du_add(subdirs, &fe);
+
+        if (fe.hidden) {
+            // filtered out; only here for -R
+        } else if (count_mode) {
+            type_count[entry_type(&fe)]++;
+        } else if (top_n) {
+            if (fe.stat_ok) top_offer(&fe, recursive_flag ? path : NULL);
+            else entry_error(path, fe.name, fe.stat_errno);
+        } else if (display_mode == 1) {
+            print_long(ob, dirfd, path, &fe);
+        } else {
+            print_colored_padded(ob, &fe, 0);
+            out_char(ob, '\n');
+        }
+
+        if (recursive_flag && is_subdir(&fe) &&
+            listing_add(subdirs, fe.name, DT_DIR, 0) < 0)
+            ls_perror("malloc");
+
+        if (dr->pos >= dr->len) out_flush(ob);
+    }
+    listing_seal(subdirs);
+}
+
+// ---- Listing cache (--cache-dir): one mmap-able index per directory ----
+#define CACHE_MAGIC "LSIDX1"
+
+/*
+ * File layout: header, 'count' fixed-size records, then the names
+ * block (NUL-terminated, back to back).  Entries are stored raw (with
+ * dotfiles, unfiltered, unsorted) so one index serves every option set.
+ */
+struct cache_header {
+    char magic[8];
+    uint32_t rec_size;      // sizeof(struct cache_rec): guards layout changes
+    uint32_t count;
+    uint64_t names_len;
+    uint64_t dev, ino;      // the directory the index describes...
+    int64_t mtime_sec, mtime_nsec, ctime_sec, ctime_nsec;  // ...and its version
+};
+
+struct cache_rec {
+    uint64_t d_ino;
+    uint64_t dev, ino, rdev;
+    int64_t size, blocks;
+    int64_t mtime_sec;
+    uint32_t mtime_nsec;
+    uint32_t mode, nlink, uid, gid;
+    uint32_t name_off;
+    int32_t stat_errno;
+    uint8_t d_type, stat_ok;
+};
+
+static void cache_name(char *buf, size_t len, const struct stat *dst) {
+    snprintf(buf, len, "%llx-%llx", (unsigned long long)dst->st_dev,
+             (unsigned long long)dst->st_ino);
+}
+
+/*
+ * Fill 'ls' from the index of directory 'dst' if one exists for its
+ * current mtime and ctime.  No readdir or lstat is done.  Returns -1 on
+ * a miss or a damaged index ('ls' is left empty).
+ */
+static int cache_load(const struct stat *dst, struct dir_listing *ls) {
+    char name[64];
+    cache_name(name, sizeof(name), dst);
+    int fd = openat(cache_fd, name, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) return -1;
+
+    struct stat cst;
+    void *map = MAP_FAILED;
+    if (fstat(fd, &cst) == 0 && (size_t)cst.st_size >= sizeof(struct cache_header))
+        map = mmap(NULL, cst.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return -1;
+
+    const struct cache_header *h = map;
+    const struct cache_rec *rec = (const struct cache_rec *)(h + 1);
+    const char *names = (const char *)(rec + h->count);
+    int ok = memcmp(h->magic, CACHE_MAGIC, sizeof(CACHE_MAGIC)) == 0 &&
+             h->rec_size == sizeof(*rec) &&
+             h->dev == (uint64_t)dst->st_dev && h->ino == (uint64_t)dst->st_ino &&
+             h->mtime_sec == dst->st_mtim.tv_sec && h->mtime_nsec == dst->st_mtim.tv_nsec &&
+             h->ctime_sec == dst->st_ctim.tv_sec && h->ctime_nsec == dst->st_ctim.tv_nsec &&
+             (uint64_t)cst.st_size == sizeof(*h) + (uint64_t)h->count * sizeof(*rec) + h->names_len &&
+             (h->names_len == 0 || names[h->names_len - 1] == '\0');
+
+    for (uint32_t i = 0; ok && i < h->count; ++i) {
+        const struct cache_rec *r = &rec[i];
+        if (r->name_off >= h->names_len ||
+            listing_add(ls, names + r->name_off, r->d_type, r->d_ino) < 0) {
+            ok = 0;
+            break;
+        }
+        struct file_entry *fe = &ls->ents[ls->n - 1];
+        fe->stat_ok = r->stat_ok;
+        fe->stat_errno = r->stat_errno;
+        memset(&fe->st, 0, sizeof(fe->st));
+        fe->st.st_dev = r->dev;
+        fe->st.st_ino = r->ino;
+        fe->st.st_rdev = r->rdev;
+        fe->st.st_size = r->size;
+        fe->st.st_blocks = r->blocks;
+        fe->st.st_mtim.tv_sec = r->mtime_sec;
+        fe->st.st_mtim.tv_nsec = r->mtime_nsec;
+        fe->st.st_mode = r->mode;
+        fe->st.st_nlink = r->nlink;
+        fe->st.st_uid = r->uid;
+        fe->st.st_gid = r->gid;
+    }
+    munmap(map, cst.st_size);
+
+    if (!ok) {
+        listing_free(ls);
+        return -1;
+    }
+    listing_seal(ls);
+    return 0;
+}
+
+/*
+ * Write the index for a fully read and stat'ed raw listing.  Best
+ * effort: any failure just leaves no index.  A directory changed in the
+ * last couple of seconds is skipped, since a later change within the
+ * same timestamp tick would go unnoticed.  Only the directory's own
+ * mtime/ctime is checked on reuse, so files changed in place (without
+ * adding, removing or renaming entries) keep their old stat fields.
+ */
+static void cache_store(const struct stat *dst, const struct dir_listing *ls) {
+    time_t now = time(NULL);
+    if (dst->st_mtim.tv_sec >= now - 1 || dst->st_ctim.tv_sec >= now - 1) return;
+
+    struct cache_rec *recs = calloc(ls->n ? ls->n : 1, sizeof(*recs));
+    if (!recs) return;
+    for (int i = 0; i < ls->n; ++i) {
+        const struct file_entry *fe = &ls->ents[i];
+        struct cache_rec *r = &recs[i];
+        r->d_ino = fe->d_ino;
+        r->d_type = fe->d_type;
+        r->name_off = fe->name_off;
+        r->stat_ok = fe->stat_ok;
+        r->stat_errno = fe->stat_errno;
+        if (!fe->stat_ok) continue;
+        r->dev = fe->st.st_dev;
+        r->ino = fe->st.st_ino;
+        r->rdev = fe->st.st_rdev;
+        r->size = fe->st.st_size;
+        r->blocks = fe->st.st_blocks;
+        r->mtime_sec = fe->st.st_mtim.tv_sec;
+        r->mtime_nsec = fe->st.st_mtim.tv_nsec;
+        r->mode = fe->st.st_mode;
+        r->nlink = fe->st.st_nlink;
+        r->uid = fe->st.st_uid;
+        r->gid = fe->st.st_gid;
+    }
+
+    struct cache_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, CACHE_MAGIC, sizeof(CACHE_MAGIC));
+    h.rec_size = sizeof(struct cache_rec);
+    h.count = ls->n;
+    h.names_len = ls->names_len;
+    h.dev = dst->st_dev;
+    h.ino = dst->st_ino;
+    h.mtime_sec = dst->st_mtim.tv_sec;
+    h.mtime_nsec = dst->st_mtim.tv_nsec;
+    h.ctime_sec = dst->st_ctim.tv_sec;
+    h.ctime_nsec = dst->st_ctim.tv_nsec;
+
+    // write a private temp file, then rename it over any old index
+    char name[64], tmp[96];
+    cache_name(name, sizeof(name), dst);
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", name, (long)syscall(SYS_gettid));
+    int fd = openat(cache_fd, tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd >= 0) {
+        struct iovec iov[3] = {
+            { &h, sizeof(h) },
+            { recs, ls->n * sizeof(*recs) },
+            { ls->names, ls->names_len },
+        };
+        write_all(fd, iov, 3);
+        struct stat cst;
+        off_t want = sizeof(h) + ls->n * sizeof(*recs) + ls->names_len;
+        int ok = fstat(fd, &cst) == 0 && cst.st_size == want;
+        close(fd);
+        if (!ok || renameat(cache_fd, tmp, cache_fd, name) < 0) unlinkat(cache_fd, tmp, 0);
+    }
+    free(recs);
+}
+
+/* raw (cached or cache-bound) listing: apply the dotfile and name/type filters now */
+static void listing_select(struct dir_listing *ls, int dirfd, int recursive_flag) {
+    int kept = 0;
+    ls->maxlen = 0;
+    for (int i = 0; i < ls->n; ++i) {
+        struct file_entry *fe = &ls->ents[i];
+        int drop = skip_name(fe->name);
+        if (!drop) {
+            fe->hidden = !filter_name_type(fe->name, entry_type(fe));
+            drop = fe->hidden && !(recursive_flag && is_subdir(fe));
         }
+        if (drop) {
+            if (du_mode) du_add_dropped(ls, dirfd, fe, recursive_flag);
+            continue;
+        }
+        if (!fe->hidden && (int)strlen(fe->name) > ls->maxlen) ls->maxlen = strlen(fe->name);
+        ls->ents[kept++] = *fe;
+    }
+    ls->n = kept;
+}
+
+// ---- Snapshot export and diff ----
+#define SNAP_MAGIC "LSSNAP1"
+
+/*
+ * Records follow the serial -R walk: each directory's entries as one
+ * block in byte order of the name, blocks in pre-order.  So the stream
+ * is ordered by (directory, name), with directories compared bytewise
+ * except that '/' sorts before every other byte.  Both sides of a diff
+ * come out in that order, which is what lets --diff merge-join them.
+ */
+static int snap_dir_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    size_t n = alen < blen ? alen : blen;
+    for (size_t i = 0; i < n; ++i) {
+        unsigned char ca = a[i] == '/' ? 1 : (unsigned char)a[i];
+        unsigned char cb = b[i] == '/' ? 1 : (unsigned char)b[i];
+        if (ca != cb) return ca < cb ? -1 : 1;
+    }
+    return alen < blen ? -1 : alen > blen;
+}
+
+static int snap_cmp(const char *a, size_t alen, const char *b, size_t blen) {
+    const char *sa = memrchr(a, '/', alen), *sb = memrchr(b, '/', blen);
+    size_t da = sa ? (size_t)(sa - a) : 0, db = sb ? (size_t)(sb - b) : 0;
+    int c = snap_dir_cmp(a, da, b, db);
+    if (c) return c;
+    const char *na = sa ? sa + 1 : a, *nb = sb ? sb + 1 : b;
+    size_t la = alen - (na - a), lb = blen - (nb - b);
+    c = memcmp(na, nb, la < lb ? la : lb);
+    if (c) return c;
+    return la < lb ? -1 : la > lb;
+}
+
+static int grow_buf(char **buf, size_t *cap, size_t need) {
+    if (need <= *cap) return 0;
+    size_t ncap = *cap ? *cap : 256;
+    while (ncap < need) ncap *= 2;
+    char *nb = realloc(*buf, ncap);
+    if (!nb) return -1;
+    *buf = nb;
+    *cap = ncap;
+    return 0;
+}
+
+/* step the --diff cursor to the next old record; have_old = 0 at the end */
+static void snap_next_old(void) {
+    struct snap_rec r;
+    snap.have_old = 0;
+    if (!snap.map || snap.map_len - snap.pos < sizeof(r)) return;
+    memcpy(&r, snap.map + snap.pos, sizeof(r));     // records aren't aligned
+    if (r.shared > snap.old_len || snap.map_len - snap.pos - sizeof(r) < r.suffix ||
+        grow_buf(&snap.old, &snap.old_cap, (size_t)r.shared + r.suffix + 1) < 0) {
+        report_error("snapshot", NULL, EINVAL);
+        snap.map_len = snap.pos;    // stop reading it
+        return;
+    }
+    memcpy(snap.old + r.shared, snap.map + snap.pos + sizeof(r), r.suffix);
+    snap.old_len = r.shared + r.suffix;
+    snap.old[snap.old_len] = '\0';
+    snap.pos += sizeof(r) + r.suffix;
+    snap.old_rec = r;
+    snap.have_old = 1;
+}
+
+static void snap_report(char mark, const char *path, const char *what) {
+    out_char(&stdout_buf, mark);
+    out_char(&stdout_buf, ' ');
+    out_str(&stdout_buf, path);
+    if (what) {
+        out_write(&stdout_buf, " [", 2);
+        out_str(&stdout_buf, what);
+        out_char(&stdout_buf, ']');
+    }
+    out_char(&stdout_buf, '\n');
+}
+
+/* same path on both sides: name the fields that moved (a directory's size/mtime don't count) */
+static void snap_compare(const char *path, const struct snap_rec *o, const struct snap_rec *n) {
+    char what[32] = "";
+    int dir = S_ISDIR(n->mode) && S_ISDIR(o->mode);
+    if (!dir && o->size != n->size) strcat(what, " size");
+    if (!dir && (o->mtime_sec != n->mtime_sec || o->mtime_nsec != n->mtime_nsec))
+        strcat(what, " mtime");
+    if (o->mode != n->mode) strcat(what, " mode");
+    if (o->ino != n->ino) strcat(what, " inode");
+    if (what[0]) snap_report('~', path, what + 1);
+}
+
+/* one walked entry: append it to --snapshot and merge it against --diff */
+static void snap_entry(const char *dir, size_t dir_len, const struct file_entry *fe) {
+    size_t nlen = strlen(fe->name), len = dir_len ? dir_len + 1 + nlen : nlen;
+    if (grow_buf(&snap.cur, &snap.cur_cap, len + 1) < 0) {
+        ls_perror("malloc");
+        return;
+    }
+    if (dir_len) {
+        memcpy(snap.cur, dir, dir_len);
+        snap.cur[dir_len] = '/';
+    }
+    memcpy(snap.cur + len - nlen, fe->name, nlen + 1);
+
+    struct snap_rec r = { 0 };
+    if (fe->stat_ok) {
+        r.ino = fe->st.st_ino;
+        r.size = fe->st.st_size;
+        r.mtime_sec = fe->st.st_mtim.tv_sec;
+        r.mtime_nsec = fe->st.st_mtim.tv_nsec;
+        r.mode = fe->st.st_mode;
+    } else {
+        entry_error(dir_len ? dir : ".", fe->name, fe->stat_errno);
+        r.mode = DTTOIF(fe->d_type);
+    }
+
+    if (snap.out.data) {
+        size_t shared = 0;
+        while (shared < snap.prev_len && shared < len && snap.prev[shared] == snap.cur[shared])
+            shared++;
+        r.shared = shared;
+        r.suffix = len - shared;
+        out_write(&snap.out, (const char *)&r, sizeof(r));
+        out_write(&snap.out, snap.cur + shared, len - shared);
+        snap.written += sizeof(r) + len - shared;
+        if (grow_buf(&snap.prev, &snap.prev_cap, len + 1) == 0) {
+            memcpy(snap.prev + shared, snap.cur + shared, len - shared + 1);
+            snap.prev_len = len;
+        } else {
+            snap.prev_len = 0;      // next record just shares nothing
+        }
+    }
+
+    if (snap.map) {
+        int c = 1;
+        while (snap.have_old && (c = snap_cmp(snap.old, snap.old_len, snap.cur, len)) < 0) {
+            snap_report('-', snap.old, NULL);
+            snap_next_old();
+        }
+        if (snap.have_old && c == 0) {
+            snap_compare(snap.cur, &snap.old_rec, &r);
+            snap_next_old();
+        } else {
+            snap_report('+', snap.cur, NULL);
+        }
+    }
+}
+
+/* a sorted directory listing from the walk becomes one block of records */
+static void snap_listing(const char *path, const struct dir_listing *ls) {
+    // recorded paths are relative to the walk root
+    const char *dir = "";
+    if (strcmp(path, snap.root) != 0)
+        dir = strcmp(snap.root, ".") == 0 ? path : path + strlen(snap.root) + 1;
+    size_t dir_len = strlen(dir);
+
+    for (int i = 0; i < ls->n; ++i)
+        if (!ls->ents[i].hidden) snap_entry(dir, dir_len, &ls->ents[i]);
+}
+
+/* map --diff and open a temp file beside --snapshot; -1 after reporting */
+static int snap_begin(const char *root, const char *out_name, const char *diff_name) {
+    snap.root = root;
+    if (diff_name) {
+        struct snap_header h;
+        struct stat st;
+        int fd = open(diff_name, O_RDONLY | O_CLOEXEC);
+        if (fd < 0 || fstat(fd, &st) < 0) {
+            ls_perror(diff_name);
+            if (fd >= 0) close(fd);
+            return -1;
+        }
+        void *map = st.st_size >= (off_t)sizeof(h)
+                  ? mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+        close(fd);
+        if (map != MAP_FAILED) memcpy(&h, map, sizeof(h));
+        if (map == MAP_FAILED || memcmp(h.magic, SNAP_MAGIC, sizeof(SNAP_MAGIC)) != 0 ||
+            h.rec_size != sizeof(struct snap_rec)) {
+            if (map != MAP_FAILED) munmap(map, st.st_size);
+            fprintf(stderr, "%s: not a snapshot file\n", diff_name);
+            return -1;
+        }
+        madvise(map, st.st_size, MADV_SEQUENTIAL);
+        snap.map = map;
+        snap.map_len = st.st_size;
+        snap.pos = sizeof(h);
+        snap_next_old();
+    }
+    if (out_name) {
+        // written under a temp name and renamed at the end, so --diff can read the same file
+        size_t len = strlen(out_name) + 32;
+        snap.tmp_name = malloc(len);
+        snap.out.data = malloc(OUTBUF_SIZE);
+        if (!snap.tmp_name || !snap.out.data) {
+            ls_perror("malloc");
+            return -1;
+        }
+        snprintf(snap.tmp_name, len, "%s.%ld.tmp", out_name, (long)getpid());
+        snap.out.fd = open(snap.tmp_name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        if (snap.out.fd < 0) {
+            ls_perror(snap.tmp_name);
+            return -1;
+        }
+        snap.out.len = 0;
+        snap.out.cap = OUTBUF_SIZE;
+        snap.out_name = out_name;
+
+        struct snap_header h = { SNAP_MAGIC, sizeof(struct snap_rec), 0 };
+        out_write(&snap.out, (const char *)&h, sizeof(h));
+        snap.written = sizeof(h);
+    }
+    snap.active = 1;
+    return 0;
+}
+
+/* whatever is left of the old snapshot was removed; move the new one into place */
+static void snap_end(void) {
+    while (snap.have_old) {
+        snap_report('-', snap.old, NULL);
+        snap_next_old();
+    }
+    if (snap.map) munmap((void *)snap.map, snap.map_len);
+
+    if (snap.out.data) {
+        struct stat st;
+        out_flush(&snap.out);
+        if (fstat(snap.out.fd, &st) < 0) {
+            ls_perror(snap.tmp_name);
+            unlink(snap.tmp_name);
+        } else if ((uint64_t)st.st_size != snap.written) {
+            report_error(snap.tmp_name, NULL, EIO);     // a write failed along the way
+            unlink(snap.tmp_name);
+        } else if (rename(snap.tmp_name, snap.out_name) < 0) {
+            ls_perror(snap.out_name);
+            unlink(snap.tmp_name);
+        }
+        close(snap.out.fd);
+        free(snap.out.data);
+    }
+    free(snap.tmp_name);
+    free(snap.prev);
+    free(snap.old);
+    free(snap.cur);
+    memset(&snap, 0, sizeof(snap));
+}
+
+/*
+ * Display the listing according to mode.  Directories hidden by a
+ * filter are lifted out while rendering and put back afterwards, so
+ * the -R walk still sees every subdirectory in sorted order.
+ */
+static void render_listing(struct outbuf *ob, int dirfd, const char *path,
+                           int display_mode, struct dir_listing *ls, int nhidden) {
+    struct file_entry *ents = ls->ents, *lifted = NULL;
+    int n = ls->n, shown = n, *pos = NULL;
+
+    if (nhidden > 0) {
+        lifted = malloc(nhidden * sizeof(*lifted));
+        pos = malloc(nhidden * sizeof(*pos));
+        if (!lifted || !pos) {
+            // can't put them back: drop them, and their subtrees with them
+            ls_perror("malloc");
+            free(lifted);
+            free(pos);
+            lifted = NULL;
+            pos = NULL;
+        }
+        shown = 0;
+        for (int i = 0, h = 0; i < n; ++i) {
+            if (!ents[i].hidden) {
+                ents[shown++] = ents[i];
+            } else if (lifted) {
+                lifted[h] = ents[i];
+                pos[h++] = i;
+            }
+        }
+        if (!lifted) ls->n = shown;
+    }
+
+    if (display_mode == 1) {
+        for (int i = 0; i < shown; ++i)
+            print_long(ob, dirfd, path, &ents[i]);
     } else if (display_mode == 2) {
-        print_horizontal(names, n, maxlen, path);
+        print_horizontal(ob, ents, shown, ls->maxlen);
     } else {
-        print_default(names, n, maxlen, path);
+        print_default(ob, ents, shown, ls->maxlen);
+    }
+
+    if (lifted) {
+        // merge back from the end: hidden entries return to their sorted slots
+        for (int i = n - 1, k = shown - 1, h = nhidden - 1; h >= 0; --i)
+            ents[i] = (pos[h] == i) ? lifted[h--] : ents[k--];
+        free(lifted);
+        free(pos);
+    }
+}
+
+/*
+ * list_dir: read, stat, sort and render directory 'name' into 'ob'.
+ * 'name' is opened relative to parent_fd (AT_FDCWD for the top level);
+ * 'path' is only used for headers and messages.
+ * display_mode: 0=default,1=-l,2=-x.  recursive_flag keeps filtered-out
+ * subdirectories (hidden) in 'ls' for the walk.
+ * Entries are read with getdents64 so d_type comes for free; each entry
+ * is lstat'ed at most once, and only when d_type can't answer the
+ * question (see entry_needs_stat). All lookups are relative to the
+ * directory fd, so the kernel never re-walks the full path.
+ * Returns the open directory fd with the sorted entries left in 'ls'
+ * (caller closes/frees both), or -1 if the directory can't be opened.
+ */
+static int list_dir(struct outbuf *ob, int parent_fd, const char *name,
+                    const char *path, int display_mode, int recursive_flag,
+                    struct dir_listing *ls) {
+    // follow a symlink given on the command line, but never during -R
+    int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+    if (parent_fd != AT_FDCWD) flags |= O_NOFOLLOW;
+    int dirfd = openat(parent_fd, name, flags);
+    struct dir_reader dr;
+    if (dirfd < 0 || dir_open(&dr, dirfd) < 0) {
+        ls_perror(path);
+        if (dirfd >= 0) close(dirfd);
+        return -1;
+    }
+
+    // Print directory header (ls -R prints headers); --top/--count print one at the end
+    if (!summary_only) {
+        out_str(ob, path);
+        out_write(ob, ":\n", 2);
+    }
+
+    if (unsorted || top_n || count_mode) {
+        stream_entries(ob, &dr, dirfd, path, display_mode, recursive_flag, ls);
+        if (dr.err) {
+            errno = dr.err;
+            ls_perror(path);
+        }
+        dir_close(&dr);
+        return dirfd;
+    }
+
+    // with --cache-dir an unchanged directory comes from its index: no readdir, no lstat
+    struct stat dst;
+    int raw = cache_fd >= 0 && fstat(dirfd, &dst) == 0;
+    if (raw && cache_load(&dst, ls) == 0) {
+        dir_close(&dr);
+        listing_select(ls, dirfd, recursive_flag);
+    } else {
+        struct linux_dirent64 *entry;
+        int complete = 1;
+
+        // Collect entries (skip hidden, and filter on name/type before any lstat);
+        // an index is built from everything, and filtered afterwards
+        while ((entry = dir_next(&dr)) != NULL) {
+            int hide = 0;
+            if (!raw) {
+                if (skip_name(entry->d_name)) {
+                    if (du_mode) du_skip_dirent(ls, dirfd, entry, recursive_flag);
+                    continue;
+                }
+                hide = !filter_name_type(entry->d_name, entry->d_type);
+                if (hide && !(recursive_flag &&
+                              (entry->d_type == DT_DIR || entry->d_type == DT_UNKNOWN))) {
+                    if (du_mode) du_skip_dirent(ls, dirfd, entry, recursive_flag);
+                    continue;
+                }
+            }
+            if (listing_add(ls, entry->d_name, entry->d_type, entry->d_ino) < 0) {
+                ls_perror("malloc");
+                complete = 0;
+                break;
+            }
+            ls->ents[ls->n - 1].hidden = hide;
+        }
+        if (dr.err) {
+            errno = dr.err;
+            ls_perror(path);
+            complete = 0;
+        }
+        dir_close(&dr);
+        listing_seal(ls);
+
+        if (raw) {
+            stat_entries(dirfd, ls->ents, ls->n, STAT_EVERY);
+            if (complete) cache_store(&dst, ls);
+            listing_select(ls, dirfd, recursive_flag);
+        } else {
+            // Stat only the entries whose d_type isn't enough
+            stat_entries(dirfd, ls->ents, ls->n, display_mode);
+        }
+    }
+
+    // under -R a subdirectory counts itself, in its own subtree total; the
+    // rest count whether or not the filters below keep them
+    if (du_mode)
+        for (int i = 0; i < ls->n; ++i)
+            if (!(recursive_flag && is_subdir(&ls->ents[i])))
+                du_add(ls, &ls->ents[i]);
+
+    // Drop what the lstat-based filters reject, so it's never sorted
+    int nhidden = 0;
+    if (filter_glob || filter_types || filter_meta)
+        nhidden = filter_listing(ls, recursive_flag);
+
+    // Sort
+    sort_entries(ls);
+
+    if (snap.active) snap_listing(path, ls);
+    else render_listing(ob, dirfd, path, display_mode, ls, nhidden);
+    return dirfd;
+}
+
+// ---- Serial -R: explicit stack of levels, bounded fds ----
+#define WALK_FD_BUDGET 64   // directory fds held open by the serial walk (at most)
+
+/*
+ * One directory on the walk stack.  Only the names of its pending
+ * subdirectories survive the listing; everything else is freed before
+ * we descend.
+ */
+struct walk_level {
+    int dirfd;              // -1 while parked to stay under WALK_FD_BUDGET
+    dev_t dev;              // identity recorded when parked, checked on reopen
+    ino_t ino;
+    size_t path_len;        // this directory's length in the shared path buffer
+    char *subdirs;          // pending subdirectory names, packed
+    size_t subdirs_len;
+    size_t next;            // offset of the next pending name
+    size_t quiet_from;      // --du: names from here on are totalled, not listed
+    int quiet;              // --du: this one is only totalled (no output)
+    uint64_t du_bytes;      // --du: subtree totals so far
+    uint64_t du_blocks;
+};
+
+/* keep just the subdirectory names of a listing, then the --du-only ones */
+static int level_take_subdirs(struct walk_level *lv, const struct dir_listing *ls) {
+    size_t len = ls->du_dirs_len;
+    for (int i = 0; i < ls->n; ++i)
+        if (is_subdir(&ls->ents[i])) len += strlen(ls->ents[i].name) + 1;
+
+    lv->subdirs = NULL;
+    lv->subdirs_len = lv->next = lv->quiet_from = 0;
+    if (len == 0) return 0;
+    if (!(lv->subdirs = malloc(len))) return -1;
+    for (int i = 0; i < ls->n; ++i) {
+        if (!is_subdir(&ls->ents[i])) continue;
+        size_t nlen = strlen(ls->ents[i].name) + 1;
+        memcpy(lv->subdirs + lv->subdirs_len, ls->ents[i].name, nlen);
+        lv->subdirs_len += nlen;
+    }
+    lv->quiet_from = lv->subdirs_len;
+    if (ls->du_dirs_len) memcpy(lv->subdirs + lv->subdirs_len, ls->du_dirs, ls->du_dirs_len);
+    lv->subdirs_len += ls->du_dirs_len;
+    return 0;
+}
+
+/*
+ * --du under -R: read a directory that isn't listed (a dot-directory
+ * without -a, say) only to add up its entries; its subdirectories all
+ * land in ls->du_dirs.  Returns the open fd like list_dir, or -1.
+ */
+static int du_scan(int parent_fd, const char *name, const char *path,
+                   struct dir_listing *ls) {
+    int dirfd = openat(parent_fd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+    struct dir_reader dr;
+    if (dirfd < 0 || dir_open(&dr, dirfd) < 0) {
+        ls_perror(path);
+        if (dirfd >= 0) close(dirfd);
+        return -1;
+    }
+
+    struct linux_dirent64 *entry;
+    while ((entry = dir_next(&dr)) != NULL)
+        du_skip_dirent(ls, dirfd, entry, 1);
+    if (dr.err) {
+        errno = dr.err;
+        ls_perror(path);
+    }
+    dir_close(&dr);
+    return dirfd;
+}
+
+/* append "/name" to the path buffer, whose current length is 'len' */
+static int path_push(char **buf, size_t *cap, size_t len, const char *name) {
+    size_t nlen = strlen(name);
+    size_t need = len + 1 + nlen + 1;
+    if (need > *cap) {
+        size_t ncap = *cap * 2;
+        while (ncap < need) ncap *= 2;
+        char *nb = realloc(*buf, ncap);
+        if (!nb) return -1;
+        *buf = nb;
+        *cap = ncap;
+    }
+    (*buf)[len++] = '/';
+    memcpy(*buf + len, name, nlen + 1);
+    return 0;
+}
+
+/*
+ * walk_serial: ls -R without recursion.  The stack holds one small
+ * walk_level per ancestor and the path lives in one shared buffer, so
+ * memory is proportional to the frontier.  At most WALK_FD_BUDGET
+ * levels keep their fd; older ones are parked and reopened through
+ * ".." of their child on the way back up, after checking it is still
+ * the same directory.
+ */
+static void walk_serial(const char *root, int display_mode) {
+    struct outbuf *ob = &stdout_buf;
+    size_t path_cap = strlen(root) + 256;
+    char *path = malloc(path_cap);
+    size_t cap = 64, depth = 0, lowest_open = 0;
+    struct walk_level *levels = malloc(cap * sizeof(*levels));
+
+    // leave at least half of RLIMIT_NOFILE for everything else
+    size_t budget = WALK_FD_BUDGET;
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 2 < budget)
+        budget = rl.rlim_cur / 2 > 2 ? rl.rlim_cur / 2 : 2;
+
+    if (!path || !levels) {
+        ls_perror("malloc");
+        free(path);
+        free(levels);
+        return;
+    }
+    strcpy(path, root);
+    // below ".", paths are shown without the "./" prefix
+    size_t skip = strcmp(root, ".") == 0 ? 2 : 0;
+
+    struct dir_listing ls = {0};
+    int fd = list_dir(ob, AT_FDCWD, root, path, display_mode, 1, &ls);
+    if (fd >= 0) {
+        levels[0].dirfd = fd;
+        levels[0].path_len = strlen(root);
+        levels[0].quiet = 0;
+        levels[0].du_bytes = ls.du_bytes;
+        levels[0].du_blocks = ls.du_blocks;
+        if (du_mode) du_add_dir(fd, &levels[0].du_bytes, &levels[0].du_blocks);
+        if (level_take_subdirs(&levels[0], &ls) < 0) ls_perror("malloc");
+        listing_free(&ls);
+        depth = 1;
+    }
+
+    while (depth > 0) {
+        struct walk_level *lv = &levels[depth - 1];
+
+        if (lv->next < lv->subdirs_len) {
+            const char *name = lv->subdirs + lv->next;
+            int quiet = lv->quiet || lv->next >= lv->quiet_from;
+            lv->next += strlen(name) + 1;
+
+            if (path_push(&path, &path_cap, lv->path_len, name) < 0) {
+                ls_perror("malloc");
+                continue;
+            }
+            // at the budget: park the oldest open ancestor before opening another
+            if (depth - lowest_open >= budget) {
+                struct walk_level *old = &levels[lowest_open++];
+                struct stat st;
+                if (fstat(old->dirfd, &st) == 0) {
+                    old->dev = st.st_dev;
+                    old->ino = st.st_ino;
+                } else {
+                    old->dev = 0;
+                    old->ino = 0;
+                }
+                close(old->dirfd);
+                old->dirfd = -1;
+            }
+
+            if (quiet) {
+                fd = du_scan(lv->dirfd, name, path + skip, &ls);
+            } else {
+                if (!summary_only) out_char(ob, '\n');   // blank line between directory outputs, like ls -R
+                fd = list_dir(ob, lv->dirfd, name, path + skip, display_mode, 1, &ls);
+            }
+            if (fd < 0) {
+                path[lv->path_len] = '\0';
+                continue;
+            }
+
+            if (depth == cap) {
+                struct walk_level *nl = realloc(levels, 2 * cap * sizeof(*levels));
+                if (!nl) {
+                    ls_perror("malloc");
+                    listing_free(&ls);
+                    close(fd);
+                    path[lv->path_len] = '\0';
+                    continue;
+                }
+                levels = nl;
+                cap *= 2;
+            }
+
+            struct walk_level *child = &levels[depth++];
+            child->dirfd = fd;
+            child->path_len = strlen(path);
+            child->quiet = quiet;
+            child->du_bytes = ls.du_bytes;
+            child->du_blocks = ls.du_blocks;
+            if (du_mode) du_add_dir(fd, &child->du_bytes, &child->du_blocks);
+            if (level_take_subdirs(child, &ls) < 0) ls_perror("malloc");
+            listing_free(&ls);
+            continue;
+        }
+
+        // this directory is finished: report its subtree (path holds it right now)
+        if (du_mode) {
+            path[lv->path_len] = '\0';
+            if (!lv->quiet)
+                du_print(ob, lv->path_len > skip ? path + skip : path, lv->du_bytes, lv->du_blocks);
+            if (depth > 1) {
+                levels[depth - 2].du_bytes += lv->du_bytes;
+                levels[depth - 2].du_blocks += lv->du_blocks;
+            }
+        }
+
+        // pop it, reopening a parked parent first
+        if (depth > 1) {
+            struct walk_level *parent = &levels[depth - 2];
+            if (parent->dirfd < 0) {
+                struct stat st;
+                parent->dirfd = openat(lv->dirfd, "..", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (parent->dirfd >= 0 &&
+                    (fstat(parent->dirfd, &st) < 0 ||
+                     st.st_dev != parent->dev || st.st_ino != parent->ino)) {
+                    close(parent->dirfd);
+                    parent->dirfd = -1;
+                    errno = ENOENT;     // moved while we were below it
+                }
+                if (parent->dirfd < 0) {
+                    path[parent->path_len] = '\0';
+                    ls_perror(parent->path_len > skip ? path + skip : path);
+                    parent->next = parent->subdirs_len;
+                }
+                lowest_open = depth - 2;
+            }
+            path[parent->path_len] = '\0';
+        }
+        close(lv->dirfd);
+        free(lv->subdirs);
+        depth--;
+        if (lowest_open > depth) lowest_open = depth;
     }
 
-    // If recursive, iterate entries and recurse on directories
+    free(levels);
+    free(path);
+}
+
+/*
+ * do_ls: list directory 'path' to stdout.
+ * If recursive_flag is non-zero, descend into subdirectories.
+ */
+void do_ls(const char *path, int display_mode, int recursive_flag) {
     if (recursive_flag) {
-        for (int i = 0; i < n; ++i) {
-            char full[PATH_MAX];
-            if (strcmp(path, ".") == 0) snprintf(full, sizeof(full), "%s", names[i]);
-            else snprintf(full, sizeof(full), "%s/%s", path, names[i]);
+        top.root = path;
+        walk_serial(path, display_mode);
+        if (top_n) {
+            // names are relative to the root; -l reads symlinks through it
+            int rootfd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            top_render(&stdout_buf, rootfd >= 0 ? rootfd : AT_FDCWD, path, display_mode);
+            if (rootfd >= 0) close(rootfd);
+        }
+        if (count_mode) count_render(&stdout_buf, path);
+        return;
+    }
+
+    struct dir_listing ls = {0};
+    int dirfd = list_dir(&stdout_buf, AT_FDCWD, path, path, display_mode, 0, &ls);
+    if (dirfd < 0) return;
+    if (top_n) top_render(&stdout_buf, dirfd, path, display_mode);
+    if (count_mode) count_render(&stdout_buf, path);
+    if (du_mode) {
+        du_add_dir(dirfd, &ls.du_bytes, &ls.du_blocks);
+        du_print(&stdout_buf, path, ls.du_bytes, ls.du_blocks);
+    }
+    listing_free(&ls);
+    close(dirfd);
+}
+
+// ---- Watch mode (-w): one full listing, then inotify-driven row updates ----
+#define WATCH_EVENTS (IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | \
+                      IN_ATTRIB | IN_CLOSE_WRITE | IN_DELETE_SELF | IN_MOVE_SELF)
+#define WATCH_IDLE_MS 1000      // how often an idle watch checks that the directory still exists
+
+struct watch_entry {
+    struct file_entry fe;   // fe.name points at name[]
+    unsigned gen;           // last rescan that saw it
+    char name[];
+};
+
+/* the listed entries by name: open addressing, linear probing, no tombstones */
+struct watch_set {
+    struct watch_entry **slots;
+    size_t cap, n;          // cap is a power of two
+    unsigned gen;
+};
+
+static size_t name_hash(const char *s, size_t cap) {
+    uint64_t h = 0xcbf29ce484222325ULL;     // FNV-1a
+    for (; *s; ++s) h = (h ^ (unsigned char)*s) * 0x100000001b3ULL;
+    return h & (cap - 1);
+}
+
+static size_t watch_slot(const struct watch_set *ws, const char *name) {
+    size_t i = name_hash(name, ws->cap);
+    while (ws->slots[i] && strcmp(ws->slots[i]->fe.name, name) != 0)
+        i = (i + 1) & (ws->cap - 1);
+    return i;
+}
+
+static int watch_grow(struct watch_set *ws) {
+    size_t ncap = ws->cap ? ws->cap * 2 : 1024;
+    struct watch_entry **ns = calloc(ncap, sizeof(*ns));
+    if (!ns) return -1;
+    for (size_t i = 0; i < ws->cap; ++i) {
+        if (!ws->slots[i]) continue;
+        size_t j = name_hash(ws->slots[i]->fe.name, ncap);
+        while (ns[j]) j = (j + 1) & (ncap - 1);
+        ns[j] = ws->slots[i];
+    }
+    free(ws->slots);
+    ws->slots = ns;
+    ws->cap = ncap;
+    return 0;
+}
+
+static struct watch_entry *watch_insert(struct watch_set *ws, const struct file_entry *fe) {
+    if (2 * (ws->n + 1) > ws->cap && watch_grow(ws) < 0) return NULL;
+    size_t len = strlen(fe->name);
+    struct watch_entry *we = malloc(sizeof(*we) + len + 1);
+    if (!we) return NULL;
+    we->fe = *fe;
+    memcpy(we->name, fe->name, len + 1);
+    we->fe.name = we->name;
+    we->gen = ws->gen;
+    ws->slots[watch_slot(ws, we->name)] = we;
+    ws->n++;
+    return we;
+}
+
+/* free slot i and shift later members of its probe run back into the gap */
+static void watch_remove(struct watch_set *ws, size_t i) {
+    free(ws->slots[i]);
+    ws->slots[i] = NULL;
+    ws->n--;
+    for (size_t j = (i + 1) & (ws->cap - 1); ws->slots[j]; j = (j + 1) & (ws->cap - 1)) {
+        size_t home = name_hash(ws->slots[j]->fe.name, ws->cap);
+        // move it if its home isn't in the (cyclic) range (i, j]
+        if ((j > i && (home <= i || home > j)) || (j < i && home <= i && home > j)) {
+            ws->slots[i] = ws->slots[j];
+            ws->slots[j] = NULL;
+            i = j;
+        }
+    }
+}
+
+/* does the rendered row differ? long rows show the stat, short ones only the color */
+static int watch_row_changed(const struct file_entry *a, const struct file_entry *b,
+                             int display_mode) {
+    if (display_mode != 1) return use_color && color_for_file(a) != color_for_file(b);
+    return a->st.st_mode != b->st.st_mode || a->st.st_nlink != b->st.st_nlink ||
+           a->st.st_uid != b->st.st_uid || a->st.st_gid != b->st.st_gid ||
+           a->st.st_size != b->st.st_size || a->st.st_mtime != b->st.st_mtime;
+}
+
+static void watch_row(struct outbuf *ob, int dirfd, const char *path, int display_mode,
+                      char mark, const struct file_entry *fe) {
+    out_char(ob, mark);
+    out_char(ob, ' ');
+    if (display_mode == 1) {
+        print_long(ob, dirfd, path, fe);
+    } else {
+        print_colored_padded(ob, fe, 0);
+        out_char(ob, '\n');
+    }
+}
+
+/*
+ * Bring one name up to date with a single lstat and print what changed:
+ * "+ row" for a new member, "- row" for one gone (or now filtered out),
+ * "~ row" when its row would render differently.
+ */
+static void watch_update(struct watch_set *ws, struct outbuf *ob, int dirfd,
+                         const char *path, int display_mode, const char *name) {
+    if (skip_name(name)) return;
+
+    struct file_entry fe = { 0 };
+    fe.name = name;
+    stat_one(dirfd, &fe);
+    int member = 0;
+    if (fe.stat_ok) {
+        fe.d_type = IFTODT(fe.st.st_mode);
+        fe.d_ino = fe.st.st_ino;
+        member = filter_name_type(name, fe.d_type) && filter_stat(&fe);
+    }
+
+    size_t i = watch_slot(ws, name);
+    struct watch_entry *we = ws->slots[i];
+    if (!member) {
+        if (!we) return;
+        watch_row(ob, dirfd, path, display_mode, '-', &we->fe);
+        watch_remove(ws, i);
+    } else if (!we) {
+        if (!(we = watch_insert(ws, &fe))) {
+            ls_perror("malloc");
+            return;
+        }
+        watch_row(ob, dirfd, path, display_mode, '+', &we->fe);
+    } else {
+        we->gen = ws->gen;
+        if (!watch_row_changed(&we->fe, &fe, display_mode)) return;
+        we->fe.st = fe.st;
+        we->fe.stat_ok = 1;
+        we->fe.d_type = fe.d_type;
+        watch_row(ob, dirfd, path, display_mode, '~', &we->fe);
+    }
+}
+
+/* events were dropped (queue overflow): re-read the directory and diff */
+static void watch_rescan(struct watch_set *ws, struct outbuf *ob, int dirfd,
+                         const char *path, int display_mode) {
+    struct dir_reader dr;
+    struct linux_dirent64 *entry;
+
+    ws->gen++;
+    if (lseek(dirfd, 0, SEEK_SET) < 0 || dir_open(&dr, dirfd) < 0) {
+        ls_perror(path);
+        return;
+    }
+    while ((entry = dir_next(&dr)) != NULL)
+        watch_update(ws, ob, dirfd, path, display_mode, entry->d_name);
+    int err = dr.err;
+    dir_close(&dr);
+    if (err) {
+        errno = err;
+        ls_perror(path);
+        return;     // a partial read proves nothing about what's gone
+    }
+    for (size_t i = 0; i < ws->cap; ) {
+        struct watch_entry *we = ws->slots[i];
+        if (we && we->gen != ws->gen) {
+            watch_row(ob, dirfd, path, display_mode, '-', &we->fe);
+            watch_remove(ws, i);    // slot i may now hold a shifted entry
+            continue;
+        }
+        ++i;
+    }
+}
+
+/*
+ * -w: list 'path' once, then follow it with inotify.  Each event costs
+ * one lstat of the name involved and prints only the rows that changed,
+ * so the work tracks the change rate, not the directory size.
+ */
+static void watch_dir(const char *path, int display_mode) {
+    struct outbuf *ob = &stdout_buf;
+    struct watch_set ws = { 0 };
+
+    // subscribe before the first read so nothing that happens during it is missed
+    int ifd = inotify_init1(IN_CLOEXEC);
+    if (ifd < 0 || inotify_add_watch(ifd, path, WATCH_EVENTS | IN_ONLYDIR) < 0) {
+        ls_perror(path);
+        if (ifd >= 0) close(ifd);
+        return;
+    }
+
+    if (watch_grow(&ws) < 0) {      // lookups assume a table, even for an empty directory
+        ls_perror("malloc");
+        close(ifd);
+        return;
+    }
+
+    struct dir_listing ls = {0};
+    int dirfd = list_dir(ob, AT_FDCWD, path, path, display_mode, 0, &ls);
+    if (dirfd < 0) {
+        free(ws.slots);
+        close(ifd);
+        return;
+    }
+    for (int i = 0; i < ls.n; ++i) {
+        if (!watch_insert(&ws, &ls.ents[i])) {
+            ls_perror("malloc");
+            break;
+        }
+    }
+    listing_free(&ls);
+    out_flush(ob);
 
+    char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+    int gone = 0;
+    while (!gone) {
+        // our open dirfd holds back IN_DELETE_SELF, so check for rmdir when idle
+        struct pollfd pfd = { ifd, POLLIN, 0 };
+        int ready = poll(&pfd, 1, WATCH_IDLE_MS);
+        if (ready == 0) {
             struct stat st;
-            if (lstat(full, &st) < 0) {
-                // skip stat failure
+            gone = fstat(dirfd, &st) == 0 && st.st_nlink == 0;
+            continue;
+        }
+        ssize_t len = ready < 0 ? -1 : read(ifd, buf, sizeof(buf));
+        if (len < 0) {
+            if (errno == EINTR) continue;
+            ls_perror("inotify");
+            break;
+        }
+        time_refresh();
+        for (char *p = buf; p < buf + len; ) {
+            const struct inotify_event *ev = (const struct inotify_event *)p;
+            if (ev->mask & IN_Q_OVERFLOW)
+                watch_rescan(&ws, ob, dirfd, path, display_mode);
+            else if (ev->mask & (IN_DELETE_SELF | IN_MOVE_SELF | IN_IGNORED))
+                gone = 1;
+            else if (ev->len)
+                watch_update(&ws, ob, dirfd, path, display_mode, ev->name);
+            p += sizeof(*ev) + ev->len;
+        }
+        out_flush(ob);
+    }
+    if (gone) report_error(path, NULL, ENOENT);
+
+    for (size_t i = 0; i < ws.cap; ++i) free(ws.slots[i]);
+    free(ws.slots);
+    close(dirfd);
+    close(ifd);
+}
+
+// ---- Parallel -R (-j N): work-stealing pool, output replayed in serial order ----
+
+/*
+ * A listed directory, shared by the subdirectories queued under it.  It
+ * lives while any of them, or any shared_fd below it, still has to open
+ * itself.  Only a bounded number keep their fd; the rest are parked
+ * (fd -1) and reopened from the nearest ancestor that kept one, checking
+ * dev/ino at each step like walk_serial.
+ */
+struct shared_fd {
+    int fd;                         // -1 while parked
+    atomic_int refs;                // queued children plus shared_fds below
+    struct shared_fd *up;           // NULL for the top level (opened from the cwd)
+    char *name;                     // parked: name relative to up
+    dev_t dev;                      // parked: identity, checked on reopen
+    ino_t ino;
+};
+
+struct walk_node {
+    char *path;
+    const char *name;               // last component of path, relative to parent_fd
+    struct walk_node *parent;       // only for the replay; may be freed before we run
+    struct shared_fd *parent_fd;    // NULL for the top level (AT_FDCWD)
+    struct outbuf out;              // rendered listing (memory only)
+    struct msg_capture err;         // captured error messages
+    struct walk_node **children;    // subdirectories, in listing order
+    int nchildren;
+    int done;                       // guarded by walk_pool.lock
+};
+
+struct work_deque {
+    pthread_mutex_t lock;
+    struct walk_node **items;       // ring buffer, cap is a power of two
+    size_t head, tail, cap;         // owner works at tail, thieves take from head
+};
+
+struct walk_pool {
+    struct work_deque *deques;
+    int nworkers;
+    int display_mode;
+    pthread_mutex_t lock;
+    pthread_cond_t work_cv;         // work was queued, or the walk is over
+    pthread_cond_t done_cv;         // some node finished
+    long queued;                    // nodes sitting in deques
+    long outstanding;               // nodes queued or being listed
+    atomic_int fds_open;            // shared_fds holding an fd
+    int fd_budget;                  // ... at most this many
+};
+
+struct walk_worker {
+    struct walk_pool *pool;
+    int self;
+};
+
+static int deque_push(struct work_deque *dq, struct walk_node *node) {
+    pthread_mutex_lock(&dq->lock);
+    if (dq->tail - dq->head == dq->cap) {
+        size_t ncap = dq->cap ? dq->cap * 2 : 64;
+        struct walk_node **ni = malloc(ncap * sizeof(*ni));
+        if (!ni) {
+            pthread_mutex_unlock(&dq->lock);
+            return -1;
+        }
+        for (size_t k = dq->head; k != dq->tail; ++k)
+            ni[k - dq->head] = dq->items[k & (dq->cap - 1)];
+        free(dq->items);
+        dq->items = ni;
+        dq->tail -= dq->head;
+        dq->head = 0;
+        dq->cap = ncap;
+    }
+    dq->items[dq->tail++ & (dq->cap - 1)] = node;
+    pthread_mutex_unlock(&dq->lock);
+    return 0;
+}
+
+/* from_head: steal the oldest (shallowest) node instead of popping the newest */
+static struct walk_node *deque_take(struct work_deque *dq, int from_head) {
+    struct walk_node *node = NULL;
+    pthread_mutex_lock(&dq->lock);
+    if (dq->head != dq->tail) {
+        if (from_head) node = dq->items[dq->head++ & (dq->cap - 1)];
+        else node = dq->items[--dq->tail & (dq->cap - 1)];
+    }
+    pthread_mutex_unlock(&dq->lock);
+    return node;
+}
+
+static void walk_process(struct walk_pool *pool, int self, struct walk_node *node);
+
+static void pool_submit(struct walk_pool *pool, int self, struct walk_node *node) {
+    pthread_mutex_lock(&pool->lock);
+    pool->outstanding++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (deque_push(&pool->deques[self], node) < 0) {
+        // no room to queue it: list it on this thread instead
+        walk_process(pool, self, node);
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    pool->queued++;
+    pthread_cond_signal(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* block until a node is available (own deque first, then steal); NULL when the walk is over */
+static struct walk_node *pool_take(struct walk_pool *pool, int self) {
+    pthread_mutex_lock(&pool->lock);
+    while (pool->queued == 0 && pool->outstanding > 0)
+        pthread_cond_wait(&pool->work_cv, &pool->lock);
+    if (pool->queued == 0) {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    pool->queued--;     // reserves one of the queued nodes for us
+    pthread_mutex_unlock(&pool->lock);
+
+    for (;;) {
+        struct walk_node *node = deque_take(&pool->deques[self], 0);
+        if (node) return node;
+        for (int k = 1; k < pool->nworkers; ++k) {
+            node = deque_take(&pool->deques[(self + k) % pool->nworkers], 1);
+            if (node) return node;
+        }
+    }
+}
+
+static void pool_finish(struct walk_pool *pool, struct walk_node *node) {
+    pthread_mutex_lock(&pool->lock);
+    node->done = 1;
+    pool->outstanding--;
+    pthread_cond_broadcast(&pool->done_cv);
+    if (pool->outstanding == 0) pthread_cond_broadcast(&pool->work_cv);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static struct walk_node *walk_node_new(struct walk_node *parent, char *path, const char *name) {
+    struct walk_node *node = calloc(1, sizeof(*node));
+    if (!node) return NULL;
+    node->path = path;
+    node->name = name;
+    node->parent = parent;
+    node->out.fd = -1;
+    node->err.out = &node->out;
+    node->err.msgs.fd = -1;
+    return node;
+}
+
+static void shared_fd_release(struct walk_pool *pool, struct shared_fd *sfd) {
+    while (sfd && atomic_fetch_sub(&sfd->refs, 1) == 1) {
+        struct shared_fd *up = sfd->up;
+        if (sfd->fd >= 0) {
+            close(sfd->fd);
+            atomic_fetch_sub(&pool->fds_open, 1);
+        }
+        free(sfd->name);
+        free(sfd);
+        sfd = up;
+    }
+}
+
+/*
+ * An fd for a (possibly parked) shared directory.  *owned is set when
+ * the caller must close it.  A parked chain is reopened top-down from
+ * the nearest ancestor still holding its fd; the caller's reference
+ * keeps the whole chain alive.
+ */
+static int shared_fd_get(struct shared_fd *sfd, int *owned) {
+    *owned = 0;
+    if (sfd->fd >= 0) return sfd->fd;
+
+    int steps = 0;
+    for (struct shared_fd *a = sfd; a->fd < 0 && a->up; a = a->up) steps++;
+
+    int fd = AT_FDCWD;
+    for (int i = steps; i >= 0; --i) {
+        struct shared_fd *a = sfd;
+        for (int k = 0; k < i; ++k) a = a->up;
+        if (a->fd >= 0) {
+            fd = a->fd;     // the open ancestor we start from
+            continue;
+        }
+
+        // the top level follows a symlink, like list_dir; nothing below it does
+        int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+        if (a->up) flags |= O_NOFOLLOW;
+        int nfd = openat(fd, a->name, flags);
+        struct stat st;
+        if (nfd >= 0 && (fstat(nfd, &st) < 0 || st.st_dev != a->dev || st.st_ino != a->ino)) {
+            close(nfd);
+            nfd = -1;
+            errno = ENOENT;     // moved while its subdirectories were queued
+        }
+        if (*owned) {
+            int saved = errno;
+            close(fd);
+            errno = saved;
+        }
+        if (nfd < 0) {
+            *owned = 0;
+            return -1;
+        }
+        fd = nfd;
+        *owned = 1;
+    }
+    return fd;
+}
+
+/* keep a listed directory's fd for its subdirectories, or park it past the budget */
+static void shared_fd_init(struct walk_pool *pool, struct shared_fd *sfd, int dirfd,
+                           const char *name) {
+    struct stat st;
+    sfd->fd = dirfd;
+    sfd->name = NULL;
+    if (atomic_fetch_add(&pool->fds_open, 1) < pool->fd_budget) return;
+    if (fstat(dirfd, &st) < 0 || !(sfd->name = strdup(name)))
+        return;             // can't park it: go over the budget rather than lose it
+    sfd->dev = st.st_dev;
+    sfd->ino = st.st_ino;
+    close(dirfd);
+    sfd->fd = -1;
+    atomic_fetch_sub(&pool->fds_open, 1);
+}
+
+/* list one directory on a worker and queue its subdirectories */
+static void walk_process(struct walk_pool *pool, int self, struct walk_node *node) {
+    struct dir_listing ls = {0};
+    int parent_fd = AT_FDCWD, owned = 0, dirfd = -1;
+
+    struct msg_capture *saved_capture = err_capture;
+    err_capture = &node->err;
+    if (node->parent_fd && (parent_fd = shared_fd_get(node->parent_fd, &owned)) < 0)
+        ls_perror(node->path);
+    else
+        dirfd = list_dir(&node->out, parent_fd, node->name, node->path,
+                         pool->display_mode, 1, &ls);
+    if (owned) close(parent_fd);
+
+    if (dirfd >= 0) {
+        int nsub = 0;
+        for (int i = 0; i < ls.n; ++i)
+            if (is_subdir(&ls.ents[i])) nsub++;
+
+        node->children = nsub ? malloc(nsub * sizeof(*node->children)) : NULL;
+        if (nsub && !node->children) {
+            ls_perror("malloc");
+            nsub = 0;
+        }
+        for (int i = 0; i < ls.n && node->nchildren < nsub; ++i) {
+            if (!is_subdir(&ls.ents[i])) continue;
+            char *full = join_path(node->path, ls.ents[i].name);
+            struct walk_node *child = full ? walk_node_new(node, full, NULL) : NULL;
+            if (!child) {
+                free(full);
+                ls_perror("malloc");
                 continue;
             }
+            child->name = full + strlen(full) - strlen(ls.ents[i].name);
+            node->children[node->nchildren++] = child;
+        }
+        listing_free(&ls);
 
-            if (S_ISDIR(st.st_mode)) {
-                // skip . and .. (we already filtered hidden, but just in case)
-                if (strcmp(names[i], ".") == 0 || strcmp(names[i], "..") == 0) continue;
-                printf("\n"); // blank line between directory outputs, like ls -R
-                do_ls(full, display_mode, recursive_flag);
+        struct shared_fd *sfd = node->nchildren ? malloc(sizeof(*sfd)) : NULL;
+        if (!sfd) {
+            if (node->nchildren) ls_perror("malloc");
+            for (int i = 0; i < node->nchildren; ++i) {
+                free(node->children[i]->path);
+                free(node->children[i]);
             }
+            node->nchildren = 0;
+            close(dirfd);
+        } else {
+            // our reference to the parent passes to the new shared_fd
+            shared_fd_init(pool, sfd, dirfd, node->name);
+            sfd->up = node->parent_fd;
+            node->parent_fd = NULL;
+            atomic_init(&sfd->refs, node->nchildren);
+            for (int i = 0; i < node->nchildren; ++i)
+                node->children[i]->parent_fd = sfd;
+            // reverse order, so this worker pops the first subdirectory next
+            for (int i = node->nchildren - 1; i >= 0; --i)
+                pool_submit(pool, self, node->children[i]);
         }
     }
+    shared_fd_release(pool, node->parent_fd);
+    err_capture = saved_capture;
+
+    pool_finish(pool, node);
+}
+
+static void *walk_worker_main(void *arg) {
+    struct walk_worker *w = arg;
+    struct walk_node *node;
+    while ((node = pool_take(w->pool, w->self)) != NULL)
+        walk_process(w->pool, w->self, node);
+    uring_teardown(&ring);
+    return NULL;
+}
+
+/* write a node's listing, splicing captured messages in where they occurred */
+static void walk_replay(struct walk_node *node) {
+    size_t pos = 0, off = 0;
+    while (off < node->err.msgs.len) {
+        size_t rec[2];
+        memcpy(rec, node->err.msgs.data + off, sizeof(rec));
+        off += sizeof(rec);
 
-    // Free memory
-    for (int i = 0; i < n; ++i) free(names[i]);
+        out_write(&stdout_buf, node->out.data + pos, rec[0] - pos);
+        pos = rec[0];
+        out_flush(&stdout_buf);
+        struct iovec iov = { node->err.msgs.data + off, rec[1] };
+        write_all(STDERR_FILENO, &iov, 1);
+        off += rec[1];
+    }
+    out_write(&stdout_buf, node->out.data + pos, node->out.len - pos);
+}
+
+/*
+ * walk_parallel: ls -R with 'jobs' worker threads.  Workers list
+ * directories into per-directory memory buffers; this thread replays
+ * them in the same pre-order as do_ls, so output is byte-identical to
+ * the serial walk.
+ */
+static void walk_parallel(const char *path, int display_mode, int jobs) {
+    struct walk_pool pool = { 0 };
+    pool.nworkers = jobs;
+    pool.display_mode = display_mode;
+    pthread_mutex_init(&pool.lock, NULL);
+    pthread_cond_init(&pool.work_cv, NULL);
+    pthread_cond_init(&pool.done_cv, NULL);
+
+    // leave at least half of RLIMIT_NOFILE, and a few per worker, for everything else
+    struct rlimit rl;
+    pool.fd_budget = INT_MAX;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY &&
+        rl.rlim_cur / 2 < (rlim_t)INT_MAX)
+        pool.fd_budget = (int)(rl.rlim_cur / 2) > 4 * jobs ? (int)(rl.rlim_cur / 2) - 4 * jobs : 0;
+
+    pool.deques = calloc(jobs, sizeof(*pool.deques));
+    struct walk_worker *workers = calloc(jobs, sizeof(*workers));
+    pthread_t *tids = calloc(jobs, sizeof(*tids));
+    char *root_path = strdup(path);
+    struct walk_node *root = root_path ? walk_node_new(NULL, root_path, root_path) : NULL;
+    size_t stack_cap = 64, depth = 0;
+    struct walk_node **stack = malloc(stack_cap * sizeof(*stack));
+    if (!pool.deques || !workers || !tids || !root || !stack) {
+        ls_perror("malloc");
+        free(pool.deques); free(workers); free(tids); free(root_path); free(root); free(stack);
+        return;
+    }
+    for (int i = 0; i < jobs; ++i)
+        pthread_mutex_init(&pool.deques[i].lock, NULL);
+
+    pool_submit(&pool, 0, root);
+
+    int started = 0;
+    for (int i = 0; i < jobs; ++i) {
+        workers[i].pool = &pool;
+        workers[i].self = i;
+        if (pthread_create(&tids[i], NULL, walk_worker_main, &workers[i]) != 0) break;
+        started++;
+    }
+    if (started == 0) {
+        // no threads at all: run the single queued node tree here
+        workers[0].pool = &pool;
+        workers[0].self = 0;
+        walk_worker_main(&workers[0]);
+    }
+
+    // Replay in serial pre-order: a node, then each child subtree in turn
+    stack[depth++] = root;
+    while (depth > 0) {
+        struct walk_node *node = stack[--depth];
+
+        pthread_mutex_lock(&pool.lock);
+        while (!node->done)
+            pthread_cond_wait(&pool.done_cv, &pool.lock);
+        pthread_mutex_unlock(&pool.lock);
+
+        if (node->parent) out_char(&stdout_buf, '\n');
+        walk_replay(node);
+
+        if (depth + node->nchildren > stack_cap) {
+            while (depth + node->nchildren > stack_cap) stack_cap *= 2;
+            struct walk_node **ns = realloc(stack, stack_cap * sizeof(*stack));
+            if (!ns) {
+                ls_perror("malloc");
+                exit(EXIT_FAILURE);
+            }
+            stack = ns;
+        }
+        for (int i = node->nchildren - 1; i >= 0; --i)
+            stack[depth++] = node->children[i];
+
+        free(node->out.data);
+        free(node->err.msgs.data);
+        free(node->children);
+        free(node->path);
+        free(node);
+    }
+
+    for (int i = 0; i < started; ++i)
+        pthread_join(tids[i], NULL);
+    for (int i = 0; i < jobs; ++i) {
+        pthread_mutex_destroy(&pool.deques[i].lock);
+        free(pool.deques[i].items);
+    }
+    free(pool.deques);
+    free(workers);
+    free(tids);
+    free(stack);
+}
+
+/* --type letters, as find -type: f d l p s b c */
+static int parse_types(const char *s, unsigned *mask) {
+    static const char letters[] = "fdlpsbc";
+    static const unsigned char types[] = { DT_REG, DT_DIR, DT_LNK, DT_FIFO, DT_SOCK, DT_BLK, DT_CHR };
+    *mask = 0;
+    for (; *s; ++s) {
+        if (*s == ',') continue;
+        const char *p = strchr(letters, *s);
+        if (!p) return -1;
+        *mask |= 1u << types[p - letters];
+    }
+    return *mask ? 0 : -1;
+}
+
+/* byte count with an optional K, M or G (powers of 1024) suffix */
+static int parse_size(const char *s, off_t *out) {
+    char *end;
+    errno = 0;
+    long long v = strtoll(s, &end, 10);
+    if (errno || end == s || v < 0) return -1;
+    int shift = 0;
+    switch (toupper((unsigned char)*end)) {
+        case 'K': shift = 10; end++; break;
+        case 'M': shift = 20; end++; break;
+        case 'G': shift = 30; end++; break;
+    }
+    if (*end || v > (LLONG_MAX >> shift)) return -1;
+    *out = (off_t)(v << shift);
+    return 0;
+}
+
+/* parallel -R keeps an fd per directory with queued children, up to a budget; raise it */
+static void raise_fd_limit(void) {
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
 }
 
 int main(int argc, char *argv[]) {
     int display_mode = 0; // 0 = default, 1 = long (-l), 2 = horizontal (-x)
     int recursive_flag = 0;
+    int jobs = 1;         // -j N: worker threads for -R, or stat threads without it
+    int watch_flag = 0;   // -w: keep following the directory
+    const char *snap_out = NULL, *snap_diff = NULL;     // --snapshot, --diff files
+    const char *color_when = "auto";
+    const char *stat_order = NULL;  // --stat-order: inode | readdir
     int opt;
 
+    static const struct option long_opts[] = {
+        { "color", optional_argument, NULL, 'C' },
+        { "stat-order", required_argument, NULL, 'O' },
+        { "name", required_argument, NULL, 'N' },
+        { "type", required_argument, NULL, 'T' },
+        { "min-size", required_argument, NULL, '<' },
+        { "max-size", required_argument, NULL, '>' },
+        { "newer", required_argument, NULL, 'W' },
+        { "top", required_argument, NULL, 'K' },
+        { "du", no_argument, NULL, 'D' },
+        { "count", no_argument, NULL, 'c' },
+        { "cache-dir", required_argument, NULL, 'I' },
+        { "snapshot", required_argument, NULL, 'P' },
+        { "diff", required_argument, NULL, 'Q' },
+        { NULL, 0, NULL, 0 },
+    };
+
     // include R (capital) in options
-    while ((opt = getopt(argc, argv, "lxR")) != -1) {
+    while ((opt = getopt_long(argc, argv, "lxRnfUtSrvj:w", long_opts, NULL)) != -1) {
         switch (opt) {
             case 'l': display_mode = 1; break;
+            case 'n': display_mode = 1; numeric_ids = 1; break;  // -n implies -l
             case 'x': display_mode = 2; break;
             case 'R': recursive_flag = 1; break;
+            case 'w': watch_flag = 1; break;
+            case 'U': unsorted = 1; break;
+            case 't': sort_by = SORT_TIME; break;
+            case 'S': sort_by = SORT_SIZE; break;
+            case 'v': sort_by = SORT_VERSION; break;
+            case 'r': sort_reverse = 1; break;
+            case 'f': unsorted = 1; show_all = 1; break;      // -f implies -a, like GNU
+            case 'C': color_when = optarg ? optarg : "always"; break;
+            case 'O': stat_order = optarg; break;
+            case 'N': filter_glob = optarg; break;
+            case 'T':
+                if (parse_types(optarg, &filter_types) < 0) {
+                    fprintf(stderr, "%s: invalid --type argument '%s' (use letters from fdlpsbc)\n",
+                            argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case '<':
+            case '>':
+                if (parse_size(optarg, opt == '<' ? &filter_min_size : &filter_max_size) < 0) {
+                    fprintf(stderr, "%s: invalid size '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                filter_meta = 1;
+                break;
+            case 'D': du_mode = 1; break;
+            case 'c': count_mode = 1; break;
+            case 'P': snap_out = optarg; break;
+            case 'Q': snap_diff = optarg; break;
+            case 'I':
+                // no usable cache just means no caching
+                cache_fd = open(optarg, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+                if (cache_fd < 0) ls_perror(optarg);
+                break;
+            case 'K':
+                top_n = atoi(optarg);
+                if (top_n < 1) {
+                    fprintf(stderr, "%s: invalid --top argument '%s'\n", argv[0], optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'W': {
+                struct stat ref;
+                if (stat(optarg, &ref) < 0) {
+                    ls_perror(optarg);
+                    exit(EXIT_FAILURE);
+                }
+                filter_newer = ref.st_mtim;
+                filter_newer_set = filter_meta = 1;
+                break;
+            }
+            case 'j':
+                jobs = atoi(optarg);
+                if (jobs >= 1) break;
+                /* fall through */
             default:
-                fprintf(stderr, "Usage: %s [-l | -x] [-R] [dir]\n", argv[0]);
+                fprintf(stderr, "Usage: %s [-l | -n | -x] [-R] [-t | -S | -v | -U | -f] [-r] [-j N] [-w] "
+                                "[--color[=auto|always|never]] [--stat-order=inode|readdir] "
+                                "[--name=GLOB] [--type=fdlpsbc] [--min-size=N] [--max-size=N] "
+                                "[--newer=FILE] [--top=N] [--du] [--count] [--cache-dir=DIR] "
+                                "[--snapshot=FILE] [--diff=FILE] [dir]\n", argv[0]);
                 exit(EXIT_FAILURE);
         }
     }
 
+    // decide color once; with it off no entry is classified or stat'ed for it
+    if (strcmp(color_when, "always") == 0) use_color = 1;
+    else if (strcmp(color_when, "never") == 0) use_color = 0;
+    else if (strcmp(color_when, "auto") == 0) use_color = isatty(STDOUT_FILENO);
+    else {
+        fprintf(stderr, "%s: invalid --color argument '%s'\n", argv[0], color_when);
+        exit(EXIT_FAILURE);
+    }
+    if (use_color) colors_init();
+
+    // -l and -R stat nearly everything; do it in inode order unless told not to
+    if (!stat_order) inode_order = display_mode == 1 || recursive_flag;
+    else if (strcmp(stat_order, "inode") == 0) inode_order = 1;
+    else if (strcmp(stat_order, "readdir") == 0) inode_order = 0;
+    else {
+        fprintf(stderr, "%s: invalid --stat-order argument '%s'\n", argv[0], stat_order);
+        exit(EXIT_FAILURE);
+    }
+
+    // order names like the system ls under the user's collation locale
+    const char *coll = setlocale(LC_COLLATE, "");
+    use_collation = coll && strcmp(coll, "C") != 0 && strcmp(coll, "POSIX") != 0;
+
     // support optionally passing directory argument
     const char *path = (optind < argc) ? argv[optind] : ".";
 
-    do_ls(path, display_mode, recursive_flag);
+    // --top keeps a heap instead of sorting, so it needs a key to rank by
+    if (top_n && count_mode) {
+        fprintf(stderr, "%s: --top and --count don't combine\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (top_n) {
+        if (unsorted || (sort_by != SORT_TIME && sort_by != SORT_SIZE)) {
+            fprintf(stderr, "%s: --top needs -t or -S\n", argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    // snapshots need the one walk order both sides agree on: serial, byte order by name
+    if (snap_out || snap_diff) {
+        if (watch_flag || unsorted || top_n || count_mode) {
+            fprintf(stderr, "%s: --snapshot/--diff can't be combined with -w, -U/-f, --top or --count\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+        sort_by = SORT_NAME;
+        sort_reverse = 0;
+        use_collation = 0;
+        if (snap_begin(path, snap_out, snap_diff) < 0) exit(EXIT_FAILURE);
+    }
+    summary_only = top_n || count_mode || snap.active;
+
+    // -w keeps one sorted directory in memory; the tree and streaming modes don't fit
+    if (watch_flag && (recursive_flag || unsorted || top_n || count_mode || du_mode)) {
+        fprintf(stderr, "%s: -w can't be combined with -R, -U/-f, --top, --count or --du\n",
+                argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    // -R spreads directories over the -j threads; otherwise they share the stats
+    if (!recursive_flag) stat_jobs = jobs;
+
+    // --top, --du, --count and snapshots keep one heap / hardlink set / tally /
+    // record stream for the whole tree, so they walk on this thread
+    if (watch_flag) {
+        watch_dir(path, display_mode);
+    } else if (recursive_flag && jobs > 1 && !top_n && !du_mode && !count_mode && !snap.active) {
+        raise_fd_limit();
+        walk_parallel(path, display_mode, jobs);
+    } else {
+        do_ls(path, display_mode, recursive_flag);
+    }
+    if (snap.active) snap_end();
+    out_flush(&stdout_buf);
 
     return 0;
 }